@@ -0,0 +1,102 @@
+export module graphics:BinFile;
+
+import :MappedFile;
+
+import math;
+
+import <array>;
+import <span>;
+import <string>;
+import <stdexcept>;
+import <cstring>;
+import <cstddef>;
+
+export namespace graphics
+{
+	// A .bin mesh, mapped into memory and checked, with its blocks exposed as views into the
+	// mapping. The views stay valid for as long as the BinFile does.
+	//
+	// The format is the vertex count as an int, one 'y' or 'n' for each of positions, colors,
+	// normals and texture coordinates, the blocks of the attributes that are present in that
+	// order, the triangle count as an int, and finally three indices per triangle.
+	class BinFile
+	{
+		MappedFile file;
+
+	public:
+		std::span<const math::Vec3> vertices;
+		std::span<const math::Vec3> colors;
+		std::span<const math::Vec3> normals;
+		std::span<const math::Vec2> textureCoordinates;
+		std::span<const std::array<unsigned int, 3>> triangles;
+
+		explicit BinFile(const std::string& filename) : file(filename)
+		{
+			const std::byte* data = file.getData();
+			std::size_t offset = 0;
+			const auto take = [&](const std::size_t size, const char* what)
+			{
+				if (size > file.getSize() - offset)
+				{
+					throw std::runtime_error(std::string(what) + " in file '" + filename +
+						"' is cut off!");
+				}
+				const std::byte* block = data + offset;
+				offset += size;
+				return block;
+			};
+			const auto readCount = [&](const char* what)
+			{
+				int count;
+				std::memcpy(&count, take(sizeof(int), what), sizeof(int));
+				if (count < 0)
+				{
+					throw std::runtime_error(std::string(what) + " in file '" + filename +
+						"' is negative!");
+				}
+				return static_cast<std::size_t>(count);
+			};
+
+			const std::size_t vertexCount = readCount("Vertex count");
+			std::array<bool, 4> present;
+			for (std::size_t i = 0; i < present.size(); i++)
+			{
+				const char flag = static_cast<char>(*take(1, "Header"));
+				if (flag != 'y' && flag != 'n')
+				{
+					throw std::runtime_error("Invalid header in file '" + filename + "'!");
+				}
+				present[i] = flag == 'y';
+			}
+			if (!present[0])
+			{
+				throw std::runtime_error("XYZ data not found in file '" + filename + "'!");
+			}
+
+			// Every block is a multiple of 4 bytes long, so the views stay aligned to floats.
+			const auto view = [&]<typename T>(std::span<const T>& span, const bool isPresent,
+				const std::size_t count, const char* what)
+			{
+				if (isPresent)
+				{
+					span = {reinterpret_cast<const T*>(take(count * sizeof(T), what)), count};
+				}
+			};
+			view(vertices, present[0], vertexCount, "XYZ data");
+			view(colors, present[1], vertexCount, "Color data");
+			view(normals, present[2], vertexCount, "Normal data");
+			view(textureCoordinates, present[3], vertexCount, "Texture coordinate data");
+			view(triangles, true, readCount("Triangle count"), "Triangle data");
+
+			for (const std::array<unsigned int, 3>& triangle : triangles)
+			{
+				if (triangle[0] >= vertexCount || triangle[1] >= vertexCount ||
+					triangle[2] >= vertexCount)
+				{
+					throw std::runtime_error("Triangle data in file '" + filename +
+						"' refers to a vertex that doesn't exist!");
+				}
+			}
+		}
+	};
+}
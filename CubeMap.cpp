@@ -2,6 +2,7 @@ export module graphics:CubeMap;
 
 import :Framebuffer;
 import :TriangleMesh;
+import :ThreadPool;
 
 import math;
 import color;
@@ -12,13 +13,24 @@ import <numbers>;
 
 export namespace graphics
 {
+	// Per-fragment state for sampling a cube map. It is kept outside of the cube map itself so
+	// that several threads can sample the same cube map at once.
+	struct CubeMapSampler
+	{
+		// Shadow map projection parameters for cameras 0-2. The coordinates p of a fragment at
+		// pixel (x, y) with depth w are sc * (x, y, 1) + w * sf.
+		std::array<math::Mat3, 3> sc;
+		std::array<math::Vec3, 3> sf;
+		std::array<math::Vec3, 3> p;
+
+		std::size_t previousHit = 0;
+	};
+
 	struct CubeMap
 	{
 		std::array<math::PinholeCamera, 6> cameras;
 		std::array<Framebuffer, 6> framebuffers;
 
-		std::size_t previousHit;
-
 		void unrollCameras()
 		{
 			cameras[1].tilt(std::numbers::pi_v<float> * 0.5f);
@@ -32,8 +44,7 @@ export namespace graphics
 		}
 
 		CubeMap() = default;
-		explicit CubeMap(const unsigned int resolution, const math::Vec3& position) :
-			previousHit(0)
+		explicit CubeMap(const unsigned int resolution, const math::Vec3& position)
 		{
 			std::fill(cameras.begin(), cameras.end(), math::PinholeCamera(
 				resolution, resolution,
@@ -45,7 +56,7 @@ export namespace graphics
 				resolution));
 		}
 		explicit CubeMap(const std::array<Framebuffer, 6>& framebuffers) :
-			framebuffers(framebuffers), previousHit(0)
+			framebuffers(framebuffers)
 		{
 			std::fill(cameras.begin(), cameras.end(), math::PinholeCamera(
 				static_cast<unsigned int>(framebuffers[0].getWidth()),
@@ -97,20 +108,29 @@ export namespace graphics
 			zFill(0.0f);
 		}
 
-		void prerender(const TriangleMesh& mesh)
+		// The faces don't share any state, so they are rendered in parallel. Mesh is either a
+		// TriangleMesh or a MeshInstance.
+		template<typename Mesh>
+		void prerender(const Mesh& mesh)
 		{
-			for (std::size_t i = 0; i < 6; i++)
-			{
-				mesh.prerender(framebuffers[i], cameras[i]);
-			}
+			getThreadPool().parallelFor(6, [&](const std::size_t i)
+				{
+					mesh.prerender(framebuffers[i], cameras[i]);
+				}
+			);
 		}
-		void render(const TriangleMesh& mesh, std::vector<DirectionalLight>& directionalLights,
-			std::vector<PointLight>& pointLights)
+		template<typename Mesh>
+		void render(const Mesh& mesh,
+			const std::vector<DirectionalLight>& directionalLights,
+			const std::vector<PointLight>& pointLights,
+			const CubeMap* reflectionMap = nullptr)
 		{
-			for (std::size_t i = 0; i < 6; i++)
-			{
-				mesh.render(framebuffers[i], cameras[i], directionalLights, pointLights);
-			}
+			getThreadPool().parallelFor(6, [&](const std::size_t i)
+				{
+					mesh.render(framebuffers[i],
+						{cameras[i], directionalLights, pointLights, reflectionMap});
+				}
+			);
 		}
 
 		void renderOnto(Framebuffer& framebuffer, const math::PinholeCamera& camera)
@@ -118,12 +138,13 @@ export namespace graphics
 			// TODO get rid of projection.
 			math::Vec3 p = camera.c;
 			math::Vec4* cb = &framebuffer[0][0];
+			std::size_t previousHit = 0;
 			for (std::size_t y = 0; y < framebuffer.getHeight(); y++)
 			{
 				math::Vec3 r = p;
 				for (std::size_t x = 0; x < framebuffer.getWidth(); x++)
 				{
-					cb[x] = lookup(r);
+					cb[x] = lookup(r, previousHit);
 					r += camera.a;
 				}
 				p += camera.b;
@@ -138,7 +159,12 @@ export namespace graphics
 			}
 		}
 
-		math::Vec4 lookup(math::Vec3 ray)
+		math::Vec4 lookup(const math::Vec3& ray) const
+		{
+			std::size_t previousHit = 0;
+			return lookup(ray, previousHit);
+		}
+		math::Vec4 lookup(math::Vec3 ray, std::size_t& previousHit) const
 		{
 			ray += getPosition();
 			math::Vec3 projection = cameras[previousHit].project(ray);
@@ -181,10 +207,11 @@ export namespace graphics
 			return color::black;
 		}
 
-		float getVisibility(const float w)
+		float getVisibility(CubeMapSampler& sampler, const float w) const
 		{
-			math::Vec3 projection = math::Vec3(cameras[previousHit].p[0],
-				cameras[previousHit].p[1], w) / cameras[previousHit].p[2];
+			const std::size_t previousHit = sampler.previousHit;
+			math::Vec3 projection = math::Vec3(sampler.p[previousHit][0],
+				sampler.p[previousHit][1], w) / sampler.p[previousHit][2];
 			if (projection.x() >= 0.0f && projection.x() < cameras[previousHit].width &&
 				projection.y() >= 0.0f && projection.y() < cameras[previousHit].width)
 			{
@@ -203,11 +230,11 @@ export namespace graphics
 			{
 				if (i != previousHit)
 				{
-					projection = math::Vec3(cameras[i].p[0], cameras[i].p[1], w) / cameras[i].p[2];
+					projection = math::Vec3(sampler.p[i][0], sampler.p[i][1], w) / sampler.p[i][2];
 					if (projection.x() >= 0.0f && projection.x() < cameras[i].width &&
 						projection.y() >= 0.0f && projection.y() < cameras[i].width)
 					{
-						previousHit = i;
+						sampler.previousHit = i;
 						if (projection.z() > 0.0f)
 						{
 							return framebuffers[i].getBilinearVisibility(projection.x(),
@@ -7,6 +7,8 @@ module;
 
 #include <glad/glad.h>
 
+#include <immintrin.h>
+
 export module graphics:Framebuffer;
 
 import :Material;
@@ -15,6 +17,7 @@ import math;
 import color;
 
 import <tuple>;
+import <array>;
 import <vector>;
 import <string>;
 import <algorithm>;
@@ -27,6 +30,178 @@ export namespace graphics
 {
 	struct DirectionalLight;
 	class PointLight;
+	struct TriangleMesh;
+	struct DrawParameters;
+	struct CubeMap;
+
+	// Everything a draw reads besides the mesh. None of it is written to while drawing, so any
+	// number of draws may run at once as long as they target different framebuffers.
+	struct RenderContext
+	{
+		const math::PinholeCamera& camera;
+		const std::vector<DirectionalLight>& directionalLights;
+		const std::vector<PointLight>& pointLights;
+		// Cube map that reflective materials reflect, if any.
+		const CubeMap* reflectionMap = nullptr;
+	};
+
+	// Narrow edge functions are evaluated in 32 bits, which overflows once a triangle spans more
+	// than about 2000 pixels. Wide edge functions are evaluated in 64 bits at the corner of every
+	// 8x8 block and in 32 bits inside of it, which allows a much larger guard band.
+	enum class EdgePrecision
+	{
+		narrow,
+		wide
+	};
+
+	// Rectangle of pixels. The bounds are inclusive.
+	struct Tile
+	{
+		int minX;
+		int minY;
+		int maxX;
+		int maxY;
+	};
+
+	// The part of the triangle setup that only depends on the camera and the vertex positions.
+	// It is shared by the depth prepass and the shading pass.
+	struct TriangleSetup
+	{
+		math::Vec3 p1;
+		math::Vec3 p2;
+		math::Vec3 p3;
+		int p1x;
+		int p1y;
+		int p2x;
+		int p2y;
+		int p3x;
+		int p3y;
+		int minX;
+		int minY;
+		int maxX;
+		int maxY;
+		// Maps the values at the vertices to the coefficients of a screen-space plane.
+		math::Mat3 inverse;
+		// Rows hold the barycentric coordinates of the vertices with respect to the triangle
+		// that was clipped, or the identity if it wasn't.
+		math::Mat3 weights;
+		// Maps the values at the vertices of the triangle that was clipped to the coefficients of
+		// a screen-space plane.
+		math::Mat3 interpolation;
+		math::Vec3 depth;
+		float minZ;
+		float maxZ;
+		bool visible;
+		// Whether rows get clipped to the span the triangle covers before visiting pixels, which
+		// pays off for thin triangles that cover little of their blocks.
+		bool spans;
+		// Index of the mesh triangle that the setup belongs to. Set by the caller.
+		std::uint32_t triangle;
+
+		// Whether the edge functions at the corners of blocks are evaluated in 64 bits.
+		bool wide;
+		// Edge functions at the center of pixel (x, y). The pixel is covered if none of them are
+		// negative.
+		int edge1(const int x, const int y) const
+		{
+			return (p3x - p2x) * ((y << 4) - p2y) - (p3y - p2y) * ((x << 4) - p2x);
+		}
+		int edge2(const int x, const int y) const
+		{
+			return (p1x - p3x) * ((y << 4) - p3y) - (p1y - p3y) * ((x << 4) - p3x);
+		}
+		int edge3(const int x, const int y) const
+		{
+			return (p2x - p1x) * ((y << 4) - p1y) - (p2y - p1y) * ((x << 4) - p1x);
+		}
+
+		// Whether the center of pixel (x, y) is covered by the triangle.
+		bool covers(const int x, const int y) const
+		{
+			if (wide)
+			{
+				return (wideEdge1(x, y) | wideEdge2(x, y) | wideEdge3(x, y)) >= 0;
+			}
+			return (edge1(x, y) | edge2(x, y) | edge3(x, y)) >= 0;
+		}
+
+		// Same as the 32-bit edge functions, but without overflowing for large triangles. The
+		// result is clamped to the 32-bit range that stepping across a block never leaves, which
+		// keeps the sign of every pixel in the block.
+		static int clampEdge(const std::int64_t edge)
+		{
+			static constexpr std::int64_t limit = 1 << 30;
+			return static_cast<int>(std::clamp(edge, -limit, limit));
+		}
+		int wideEdge1(const int x, const int y) const
+		{
+			return clampEdge(static_cast<std::int64_t>(p3x - p2x) * ((y << 4) - p2y) -
+				static_cast<std::int64_t>(p3y - p2y) * ((x << 4) - p2x));
+		}
+		int wideEdge2(const int x, const int y) const
+		{
+			return clampEdge(static_cast<std::int64_t>(p1x - p3x) * ((y << 4) - p3y) -
+				static_cast<std::int64_t>(p1y - p3y) * ((x << 4) - p3x));
+		}
+		int wideEdge3(const int x, const int y) const
+		{
+			return clampEdge(static_cast<std::int64_t>(p2x - p1x) * ((y << 4) - p1y) -
+				static_cast<std::int64_t>(p2y - p1y) * ((x << 4) - p1x));
+		}
+	};
+
+	// Vertex transformed into the space of a camera, which is shared by every triangle that uses
+	// the vertex.
+	struct TransformedVertex
+	{
+		// Position relative to the center of the camera, for back-face culling.
+		math::Vec3 view;
+		// PinholeCamera::projectionMatrix * view. The screen coordinates are q.x / q.z and
+		// q.y / q.z.
+		math::Vec3 q;
+	};
+
+	TransformedVertex transformVertex(const math::PinholeCamera& camera, const math::Vec3& vertex)
+	{
+		const math::Vec3 view = vertex - camera.center;
+		return {view, camera.projectionMatrix * view};
+	}
+
+	// Part of a tile that is at least partially covered by a triangle.
+	struct Block
+	{
+		int minX;
+		int minY;
+		int maxX;
+		int maxY;
+		// Edge functions at (minX, minY).
+		int u1;
+		int u2;
+		int u3;
+		// Whether every pixel of the block is covered, in which case the edge functions don't
+		// need to be tested.
+		bool full;
+	};
+
+	// Bounds of the triangle's depth over the block. The depth plane is evaluated at the corners
+	// of the block and clamped to the depths of the vertices, since the corners may lie outside
+	// of the triangle.
+	float getMinZ(const TriangleSetup& setup, const Block& block)
+	{
+		return std::max(setup.minZ, setup.depth[2] +
+			std::min(setup.depth[0] * static_cast<float>(block.minX),
+				setup.depth[0] * static_cast<float>(block.maxX)) +
+			std::min(setup.depth[1] * static_cast<float>(block.minY),
+				setup.depth[1] * static_cast<float>(block.maxY)));
+	}
+	float getMaxZ(const TriangleSetup& setup, const Block& block)
+	{
+		return std::min(setup.maxZ, setup.depth[2] +
+			std::max(setup.depth[0] * static_cast<float>(block.minX),
+				setup.depth[0] * static_cast<float>(block.maxX)) +
+			std::max(setup.depth[1] * static_cast<float>(block.minY),
+				setup.depth[1] * static_cast<float>(block.maxY)));
+	}
 
 	class Framebuffer
 	{
@@ -34,11 +209,318 @@ export namespace graphics
 		std::vector<float> zBuffer;
 		std::size_t width;
 		std::size_t height;
+		EdgePrecision edgePrecision = EdgePrecision::narrow;
+		std::vector<std::vector<std::uint32_t>> bins;
+
+		// Hierarchical z-buffer holding the minimum and maximum depth of every 8x8 block and of
+		// every tile. The tile level gets rebuilt from the block level when it is needed.
+		std::vector<float> blockMinZ;
+		std::vector<float> blockMaxZ;
+		std::vector<float> tileMinZ;
+		std::vector<float> tileMaxZ;
+		std::vector<std::uint8_t> tileOutdated;
+
+		std::size_t getBlockCountX() const
+		{
+			return (width + blockSize - 1) / blockSize;
+		}
+		std::size_t getBlockIndex(const int x, const int y) const
+		{
+			return y / blockSize * getBlockCountX() + x / blockSize;
+		}
+		std::size_t getTileIndex(const int x, const int y) const
+		{
+			return y / tileSize * getTileCountX() + x / tileSize;
+		}
+
+		// Recompute the depth range of the 8x8 block containing pixel (x, y).
+		void updateBlockZ(const int x, const int y)
+		{
+			const std::size_t minX = x / blockSize * blockSize;
+			const std::size_t minY = y / blockSize * blockSize;
+			const std::size_t maxX = std::min(minX + blockSize, width);
+			const std::size_t maxY = std::min(minY + blockSize, height);
+			float minZ = zBuffer[minY * width + minX];
+			float maxZ = minZ;
+			for (std::size_t i = minY; i < maxY; i++)
+			{
+				for (std::size_t j = minX; j < maxX; j++)
+				{
+					minZ = std::min(minZ, zBuffer[i * width + j]);
+					maxZ = std::max(maxZ, zBuffer[i * width + j]);
+				}
+			}
+			blockMinZ[getBlockIndex(x, y)] = minZ;
+			blockMaxZ[getBlockIndex(x, y)] = maxZ;
+			tileOutdated[getTileIndex(x, y)] = true;
+		}
+		void updateTileZ(const std::size_t i)
+		{
+			const Tile tile = getTile(i);
+			float minZ = blockMinZ[getBlockIndex(tile.minX, tile.minY)];
+			float maxZ = blockMaxZ[getBlockIndex(tile.minX, tile.minY)];
+			for (int y = tile.minY; y <= tile.maxY; y += blockSize)
+			{
+				for (int x = tile.minX; x <= tile.maxX; x += blockSize)
+				{
+					minZ = std::min(minZ, blockMinZ[getBlockIndex(x, y)]);
+					maxZ = std::max(maxZ, blockMaxZ[getBlockIndex(x, y)]);
+				}
+			}
+			tileMinZ[i] = minZ;
+			tileMaxZ[i] = maxZ;
+			tileOutdated[i] = false;
+		}
+
+		// Vertex in the space of PinholeCamera::projectionMatrix, where the screen coordinates are
+		// q.x / q.z and q.y / q.z.
+		struct ClipVertex
+		{
+			math::Vec3 q;
+			math::Vec3 weights;
+		};
+
+		void setupTriangle(TriangleSetup& setup, const ClipVertex& v1, const ClipVertex& v2,
+			const ClipVertex& v3) const
+		{
+			// https://fgiesen.wordpress.com/2013/02/08/triangle-rasterization-in-practice/
+			// https://fgiesen.wordpress.com/2013/02/10/optimizing-the-basic-rasterizer/
+			// http://devmaster.net/forums/topic/1145-advanced-rasterization/ (accessible with
+			// Wayback Machine)
+			setup.visible = false;
+			setup.wide = edgePrecision == EdgePrecision::wide;
+			setup.p1 = {v1.q.x() / v1.q.z(), v1.q.y() / v1.q.z(), 1.0f / v1.q.z()};
+			setup.p2 = {v2.q.x() / v2.q.z(), v2.q.y() / v2.q.z(), 1.0f / v2.q.z()};
+			setup.p3 = {v3.q.x() / v3.q.z(), v3.q.y() / v3.q.z(), 1.0f / v3.q.z()};
+
+			// 4-bit subpixel precision.
+			setup.p1x = static_cast<int>(std::round(setup.p1.x() * 16.0f));
+			setup.p1y = static_cast<int>(std::round(setup.p1.y() * 16.0f));
+			setup.p2x = static_cast<int>(std::round(setup.p2.x() * 16.0f));
+			setup.p2y = static_cast<int>(std::round(setup.p2.y() * 16.0f));
+			setup.p3x = static_cast<int>(std::round(setup.p3.x() * 16.0f));
+			setup.p3y = static_cast<int>(std::round(setup.p3.y() * 16.0f));
+
+			setup.minX = std::max(
+				(std::min(std::min(setup.p1x, setup.p2x), setup.p3x) + 15) >> 4, 0);
+			setup.minY = std::max(
+				(std::min(std::min(setup.p1y, setup.p2y), setup.p3y) + 15) >> 4, 0);
+			setup.maxX = std::min(
+				(std::max(std::max(setup.p1x, setup.p2x), setup.p3x) + 15) >> 4,
+				static_cast<int>(width) - 1
+			);
+			setup.maxY = std::min(
+				(std::max(std::max(setup.p1y, setup.p2y), setup.p3y) + 15) >> 4,
+				static_cast<int>(height) - 1
+			);
+			if (setup.minX > setup.maxX || setup.minY > setup.maxY)
+			{
+				return;
+			}
+
+			setup.inverse = math::Mat3(
+				setup.p1.x(), setup.p1.y(), 1.0f,
+				setup.p2.x(), setup.p2.y(), 1.0f,
+				setup.p3.x(), setup.p3.y(), 1.0f
+			).inverse();
+			setup.weights = math::Mat3(v1.weights, v2.weights, v3.weights);
+			setup.interpolation = setup.inverse * setup.weights;
+			setup.depth = setup.inverse * math::Vec3(setup.p1.z(), setup.p2.z(), setup.p3.z());
+			setup.minZ = std::min(std::min(setup.p1.z(), setup.p2.z()), setup.p3.z());
+			setup.maxZ = std::max(std::max(setup.p1.z(), setup.p2.z()), setup.p3.z());
+
+			// Twice the area, in the same units as the bounding box below.
+			const float area = std::abs(static_cast<float>(setup.p2x - setup.p1x) *
+				static_cast<float>(setup.p3y - setup.p1y) -
+				static_cast<float>(setup.p3x - setup.p1x) *
+				static_cast<float>(setup.p2y - setup.p1y)) / 256.0f;
+			const int boundsWidth = (std::max(std::max(setup.p1x, setup.p2x), setup.p3x) -
+				std::min(std::min(setup.p1x, setup.p2x), setup.p3x)) >> 4;
+			const int boundsHeight = (std::max(std::max(setup.p1y, setup.p2y), setup.p3y) -
+				std::min(std::min(setup.p1y, setup.p2y), setup.p3y)) >> 4;
+			setup.spans = boundsWidth > blockSize &&
+				area < spanCoverage * 2.0f * static_cast<float>(boundsWidth * boundsHeight);
+			setup.visible = true;
+		}
+
+		template<bool writeVisibility>
+		void rasterizeDepth(const TriangleSetup& setup, const Tile& tile,
+			const std::uint32_t triangle, std::uint32_t* visibility)
+		{
+			const int fa1 = (setup.p1y - setup.p2y) << 4;
+			const int fa2 = (setup.p2y - setup.p3y) << 4;
+			const int fa3 = (setup.p3y - setup.p1y) << 4;
+			const int fb1 = (setup.p2x - setup.p1x) << 4;
+			const int fb2 = (setup.p3x - setup.p2x) << 4;
+			const int fb3 = (setup.p1x - setup.p3x) << 4;
+
+			const math::Vec3& rc = setup.depth;
+
+#ifdef __AVX2__
+			// Lane i holds the values of the pixel i to the right of the start of the row.
+			const __m256i lanes = _mm256_setr_epi32(0, 1, 2, 3, 4, 5, 6, 7);
+			const __m256i lv1 = _mm256_mullo_epi32(lanes, _mm256_set1_epi32(fa2));
+			const __m256i lv2 = _mm256_mullo_epi32(lanes, _mm256_set1_epi32(fa3));
+			const __m256i lv3 = _mm256_mullo_epi32(lanes, _mm256_set1_epi32(fa1));
+			const __m256 lz = _mm256_mul_ps(_mm256_cvtepi32_ps(lanes), _mm256_set1_ps(rc[0]));
+			const __m256 epsilon = _mm256_set1_ps(math::epsilon);
+#endif
+
+			forEachBlock(setup, tile, [&](const Block& block)
+				{
+					// Nothing in the block would change. Equal depths still claim pixels of the
+					// visibility buffer.
+					const float maxZ = getMaxZ(setup, block) - math::epsilon;
+					const float blockZ = blockMinZ[getBlockIndex(block.minX, block.minY)];
+					if (writeVisibility ? maxZ < blockZ : maxZ <= blockZ)
+					{
+						return;
+					}
+
+					int u1 = block.u1;
+					int u2 = block.u2;
+					int u3 = block.u3;
+					float w = rc.dot({
+						static_cast<float>(block.minX),
+						static_cast<float>(block.minY),
+						1.0f
+					});
+
+					float* zb = zBuffer.data() + block.minY * width;
+					for (int y = block.minY; y <= block.maxY; y++)
+					{
+#ifdef __AVX2__
+						if (block.maxX - block.minX == blockSize - 1)
+						{
+							const __m256 previous = _mm256_loadu_ps(zb + block.minX);
+							const __m256 z = _mm256_sub_ps(
+								_mm256_add_ps(_mm256_set1_ps(w), lz), epsilon);
+							// A pixel is covered if none of the sign bits are set.
+							__m256 passed = block.full ?
+								_mm256_castsi256_ps(_mm256_set1_epi32(-1)) :
+								_mm256_castsi256_ps(_mm256_cmpgt_epi32(_mm256_or_si256(
+									_mm256_or_si256(
+										_mm256_add_epi32(_mm256_set1_epi32(u1), lv1),
+										_mm256_add_epi32(_mm256_set1_epi32(u2), lv2)
+									),
+									_mm256_add_epi32(_mm256_set1_epi32(u3), lv3)
+								), _mm256_set1_epi32(-1)));
+							if constexpr (writeVisibility)
+							{
+								passed = _mm256_and_ps(passed,
+									_mm256_cmp_ps(z, previous, _CMP_GE_OQ));
+								__m256i* vb = reinterpret_cast<__m256i*>(visibility +
+									(y - tile.minY) * tileSize + block.minX - tile.minX);
+								_mm256_storeu_si256(vb, _mm256_blendv_epi8(
+									_mm256_loadu_si256(vb),
+									_mm256_set1_epi32(static_cast<int>(triangle)),
+									_mm256_castps_si256(passed)
+								));
+								_mm256_storeu_ps(zb + block.minX,
+									_mm256_blendv_ps(previous, z, passed));
+							}
+							else
+							{
+								_mm256_storeu_ps(zb + block.minX, _mm256_blendv_ps(previous,
+									_mm256_max_ps(previous, z), passed));
+							}
+						}
+						else
+#endif
+						{
+							int v1 = u1;
+							int v2 = u2;
+							int v3 = u3;
+							float z = w;
+							int first = block.minX;
+							int last = block.maxX;
+							if (setup.spans && !block.full)
+							{
+								std::tie(first, last) = getSpan(setup, block, u1, u2, u3);
+								const int skip = std::max(first - block.minX, 0);
+								v1 += skip * fa2;
+								v2 += skip * fa3;
+								v3 += skip * fa1;
+								z += static_cast<float>(skip) * rc[0];
+							}
+							for (int x = first; x <= last; x++)
+							{
+								if (block.full || (v1 | v2 | v3) >= 0)
+								{
+									if constexpr (writeVisibility)
+									{
+										if (z - math::epsilon >= zb[x])
+										{
+											zb[x] = z - math::epsilon;
+											visibility[(y - tile.minY) * tileSize + x -
+												tile.minX] = triangle;
+										}
+									}
+									else
+									{
+										zb[x] = std::max(zb[x], z - math::epsilon);
+									}
+								}
+
+								v1 += fa2;
+								v2 += fa3;
+								v3 += fa1;
+								z += rc[0];
+							}
+						}
+
+						u1 += fb2;
+						u2 += fb3;
+						u3 += fb1;
+						w += rc[1];
+						zb += width;
+					}
+					updateBlockZ(block.minX, block.minY);
+				}
+			);
+		}
+
+		// Shade the part of a triangle inside a tile. makeLayout() returns the vertex layout,
+		// which decides which attributes get interpolated across the triangle, see
+		// rasterizer.cpp. It isn't called if none of the pixels of a small triangle pass.
+		template<typename MakeLayout>
+		void shadeTriangle(const TriangleSetup& setup, const Tile& tile,
+			const RenderContext& context, const MakeLayout& makeLayout,
+			const Material& material);
 
 	public:
+		static constexpr std::size_t tileSize = 64;
+		static constexpr int blockSize = 8;
+		// Marks pixels of a visibility buffer that no triangle has been written to.
+		static constexpr std::uint32_t noTriangle = 0xFFFFFFFFu;
+		// Clipping a triangle against the near plane and the guard band gives a polygon with up
+		// to 8 vertices.
+		static constexpr std::size_t maxClippedTriangles = 6;
+		// Triangles that cover less than this fraction of their bounding box are rasterized in
+		// spans.
+		static constexpr float spanCoverage = 0.25f;
+		// Triangles that cover at most this many pixels of a tile are shaded pixel by pixel
+		// instead of block by block.
+		static constexpr int smallTriangleSize = 4;
+		// Half the size of the guard band in pixels. Vertices inside of it are rasterized
+		// without clipping, and keeping them inside keeps the edge functions within 32 bits.
+		static constexpr float guardBand = 1000.0f;
+		// Guard band for wide edge functions. The steps of the edge functions across a tile
+		// still fit in 32 bits.
+		static constexpr float wideGuardBand = 16384.0f;
+
 		Framebuffer() = default;
 		explicit Framebuffer(const std::size_t width, const std::size_t height) :
-			buffer(width * height), zBuffer(width * height), width(width), height(height) {}
+			buffer(width * height), zBuffer(width * height), width(width), height(height),
+			blockMinZ(getBlockCountX() * ((height + blockSize - 1) / blockSize)),
+			blockMaxZ(blockMinZ.size()), tileMinZ(getTileCount()), tileMaxZ(getTileCount()),
+			tileOutdated(getTileCount())
+		{
+			if (std::max(width, height) > 2 * static_cast<std::size_t>(guardBand))
+			{
+				edgePrecision = EdgePrecision::wide;
+			}
+		}
 		explicit Framebuffer(const std::string& filename)
 		{
 			cimg_library::CImg<float> image(filename.c_str());
@@ -82,6 +564,8 @@ export namespace graphics
 			return buffer.data() + i * width;
 		}
 
+		// Writing through this skips the hierarchical z-buffer, so only do it between zFill() and
+		// the next depth prepass.
 		float& zLookup(const std::size_t x, const std::size_t y)
 		{
 			return zBuffer[y * width + x];
@@ -111,6 +595,16 @@ export namespace graphics
 				(fx2 - x) * (y - fy1) * buffer[y2 * width + x1] +
 				(x - fx1) * (y - fy1) * buffer[y2 * width + x2];
 		}
+		// Bilinear lookup with texture coordinates that repeat by mirroring the texture.
+		math::Vec4 textureLookup(float x, float y) const
+		{
+			const float fx = std::floor(x);
+			const float fy = std::floor(y);
+			x = static_cast<int>(fx) % 2 ? 1.0f + fx - x : x - fx;
+			y = static_cast<int>(fy) % 2 ? 1.0f + fy - y : y - fy;
+			return bilinearLookup(x * static_cast<float>(width - 1),
+				y * static_cast<float>(height - 1));
+		}
 
 		float getVisibility(const std::size_t x, const std::size_t y, const float z) const
 		{
@@ -156,119 +650,628 @@ export namespace graphics
 			{
 				zBuffer[i] = z;
 			}
+			std::fill(blockMinZ.begin(), blockMinZ.end(), z);
+			std::fill(blockMaxZ.begin(), blockMaxZ.end(), z);
+			std::fill(tileMinZ.begin(), tileMinZ.end(), z);
+			std::fill(tileMaxZ.begin(), tileMaxZ.end(), z);
+			std::fill(tileOutdated.begin(), tileOutdated.end(), false);
 		}
 		void zClear()
 		{
 			zFill(0.0f);
 		}
 
-		// Only affect the z-buffer.
-		void prerenderTriangle(const math::PinholeCamera& camera,
-			const math::Vec3& t1, const math::Vec3& t2, const math::Vec3& t3)
+		std::size_t getTileCountX() const
 		{
-			// https://fgiesen.wordpress.com/2013/02/08/triangle-rasterization-in-practice/
-			// https://fgiesen.wordpress.com/2013/02/10/optimizing-the-basic-rasterizer/
-			// http://devmaster.net/forums/topic/1145-advanced-rasterization/ (accessible with
-			// Wayback Machine)
+			return (width + tileSize - 1) / tileSize;
+		}
+		std::size_t getTileCountY() const
+		{
+			return (height + tileSize - 1) / tileSize;
+		}
+		std::size_t getTileCount() const
+		{
+			return getTileCountX() * getTileCountY();
+		}
+		Tile getTile(const std::size_t i) const
+		{
+			const int minX = static_cast<int>(i % getTileCountX() * tileSize);
+			const int minY = static_cast<int>(i / getTileCountX() * tileSize);
+			return {
+				minX,
+				minY,
+				std::min(minX + static_cast<int>(tileSize) - 1, static_cast<int>(width) - 1),
+				std::min(minY + static_cast<int>(tileSize) - 1, static_cast<int>(height) - 1)
+			};
+		}
+
+		// Call f(i, tile) for every tile that overlaps the bounding box of the triangle.
+		template<typename F>
+		void forEachTile(const TriangleSetup& setup, F f) const
+		{
+			const std::size_t tileCountX = getTileCountX();
+			for (std::size_t y = setup.minY / tileSize; y <= setup.maxY / tileSize; y++)
+			{
+				for (std::size_t x = setup.minX / tileSize; x <= setup.maxX / tileSize; x++)
+				{
+					f(y * tileCountX + x, getTile(y * tileCountX + x));
+				}
+			}
+		}
+
+		// Call f(block) for every 8x8 block of the triangle's bounding box inside the tile that
+		// isn't entirely outside of the triangle. Since the edge functions are linear, their
+		// minimum and maximum over a block are found at its corners.
+		template<typename F>
+		static void forEachBlock(const TriangleSetup& setup, const Tile& tile, F f)
+		{
+			const int minX = std::max(setup.minX, tile.minX);
+			const int minY = std::max(setup.minY, tile.minY);
+			const int maxX = std::min(setup.maxX, tile.maxX);
+			const int maxY = std::min(setup.maxY, tile.maxY);
+
+			const int fa1 = (setup.p1y - setup.p2y) << 4;
+			const int fa2 = (setup.p2y - setup.p3y) << 4;
+			const int fa3 = (setup.p3y - setup.p1y) << 4;
+			const int fb1 = (setup.p2x - setup.p1x) << 4;
+			const int fb2 = (setup.p3x - setup.p2x) << 4;
+			const int fb3 = (setup.p1x - setup.p3x) << 4;
+
+			Block block;
+			for (block.minY = minY; block.minY <= maxY; block.minY = block.maxY + 1)
+			{
+				block.maxY = std::min(block.minY | (blockSize - 1), maxY);
+				const int h = block.maxY - block.minY;
+				for (block.minX = minX; block.minX <= maxX; block.minX = block.maxX + 1)
+				{
+					block.maxX = std::min(block.minX | (blockSize - 1), maxX);
+					const int w = block.maxX - block.minX;
+
+					if (setup.wide)
+					{
+						block.u1 = setup.wideEdge1(block.minX, block.minY);
+						block.u2 = setup.wideEdge2(block.minX, block.minY);
+						block.u3 = setup.wideEdge3(block.minX, block.minY);
+					}
+					else
+					{
+						block.u1 = setup.edge1(block.minX, block.minY);
+						block.u2 = setup.edge2(block.minX, block.minY);
+						block.u3 = setup.edge3(block.minX, block.minY);
+					}
+					if (block.u1 + std::max(fa2, 0) * w + std::max(fb2, 0) * h < 0 ||
+						block.u2 + std::max(fa3, 0) * w + std::max(fb3, 0) * h < 0 ||
+						block.u3 + std::max(fa1, 0) * w + std::max(fb1, 0) * h < 0)
+					{
+						continue;
+					}
+					block.full = block.u1 + std::min(fa2, 0) * w + std::min(fb2, 0) * h >= 0 &&
+						block.u2 + std::min(fa3, 0) * w + std::min(fb3, 0) * h >= 0 &&
+						block.u3 + std::min(fa1, 0) * w + std::min(fb1, 0) * h >= 0;
+					f(block);
+				}
+			}
+		}
 
+		// First and last pixel that the triangle covers on a row of the block, given the edge
+		// functions at the start of the row. The span is empty if first > last.
+		static std::tuple<int, int> getSpan(const TriangleSetup& setup, const Block& block,
+			const int v1, const int v2, const int v3)
+		{
+			int first = block.minX;
+			int last = block.maxX;
+			const auto clip = [&](const int v, const int step)
+			{
+				if (step > 0)
+				{
+					if (v < 0)
+					{
+						first = std::max(first, block.minX + (step - 1 - v) / step);
+					}
+				}
+				else if (v < 0)
+				{
+					last = block.minX - 1;
+				}
+				else if (step < 0)
+				{
+					last = std::min(last, block.minX + v / -step);
+				}
+			};
+			clip(v1, (setup.p2y - setup.p3y) << 4);
+			clip(v2, (setup.p3y - setup.p1y) << 4);
+			clip(v3, (setup.p1y - setup.p2y) << 4);
+			return {first, last};
+		}
+
+		// Sort the visible triangles into the tiles they overlap. Each tile keeps its triangles
+		// in submission order, so rendering a tile's bin gives the same result as rendering the
+		// triangles one by one.
+		void binTriangles(const std::vector<TriangleSetup>& setups)
+		{
+			bins.resize(getTileCount());
+			for (std::vector<std::uint32_t>& bin : bins)
+			{
+				bin.clear();
+			}
+			for (std::size_t i = 0; i < setups.size(); i++)
+			{
+				if (setups[i].visible)
+				{
+					forEachTile(setups[i], [this, i](const std::size_t j, const Tile&)
+						{
+							bins[j].push_back(static_cast<std::uint32_t>(i));
+						}
+					);
+				}
+			}
+		}
+		const std::vector<std::uint32_t>& getBin(const std::size_t i) const
+		{
+			return bins[i];
+		}
+
+		// Clip the triangle against the near plane of the camera, and against the guard band if
+		// any of its vertices lies outside of it. Returns how many triangles were written to
+		// setups, some of which may still turn out to be invisible.
+		std::size_t setupTriangle(const math::PinholeCamera& camera, const TransformedVertex& t1,
+			const TransformedVertex& t2, const TransformedVertex& t3,
+			std::array<TriangleSetup, maxClippedTriangles>& setups) const
+		{
 			// Back-face culling.
-			if ((t1 - camera.center).dot((t2 - t1).cross(t3 - t1)) >= 0.0f)
+			if (t1.view.dot((t2.view - t1.view).cross(t3.view - t1.view)) >= 0.0f)
 			{
-				return;
+				return 0;
 			}
 
-			const math::Vec3 p1 = camera.project(t1);
-			const math::Vec3 p2 = camera.project(t2);
-			const math::Vec3 p3 = camera.project(t3);
+			std::array<ClipVertex, maxClippedTriangles + 2> polygon;
+			polygon[0] = {t1.q, {1.0f, 0.0f, 0.0f}};
+			polygon[1] = {t2.q, {0.0f, 1.0f, 0.0f}};
+			polygon[2] = {t3.q, {0.0f, 0.0f, 1.0f}};
+			std::size_t count = 3;
 
-			if (p1.z() <= 0.0f || p2.z() <= 0.0f || p3.z() <= 0.0f)
+			// A vertex q is inside of a plane (a, b, c, d) if a q.x + b q.y + c q.z + d >= 0. The
+			// near plane comes first so that every vertex is in front of the camera when the
+			// guard band, which relies on the division by q.z, is clipped against.
+			const float centerX = static_cast<float>(width) / 2.0f;
+			const float centerY = static_cast<float>(height) / 2.0f;
+			const float extent = std::max(std::max(edgePrecision == EdgePrecision::wide ?
+				wideGuardBand : guardBand, centerX), centerY);
+			const std::array<math::Vec4, 5> planes = {
+				math::Vec4(0.0f, 0.0f, 1.0f, -camera.nearDistance / camera.getFocalLength()),
+				math::Vec4(1.0f, 0.0f, extent - centerX, 0.0f),
+				math::Vec4(-1.0f, 0.0f, extent + centerX, 0.0f),
+				math::Vec4(0.0f, 1.0f, extent - centerY, 0.0f),
+				math::Vec4(0.0f, -1.0f, extent + centerY, 0.0f)
+			};
+			for (const math::Vec4& plane : planes)
 			{
-				return;
+				std::array<float, maxClippedTriangles + 2> distances;
+				bool inside = true;
+				for (std::size_t i = 0; i < count; i++)
+				{
+					distances[i] = plane.subvector<0, 3>().dot(polygon[i].q) + plane.w();
+					inside = inside && distances[i] >= 0.0f;
+				}
+				if (inside)
+				{
+					continue;
+				}
+
+				std::array<ClipVertex, maxClippedTriangles + 2> clipped;
+				std::size_t clippedCount = 0;
+				for (std::size_t i = 0; i < count; i++)
+				{
+					const std::size_t j = (i + 1) % count;
+					if (distances[i] >= 0.0f)
+					{
+						clipped[clippedCount++] = polygon[i];
+					}
+					if ((distances[i] >= 0.0f) != (distances[j] >= 0.0f))
+					{
+						const float t = distances[i] / (distances[i] - distances[j]);
+						clipped[clippedCount++] = {
+							polygon[i].q + t * (polygon[j].q - polygon[i].q),
+							polygon[i].weights + t * (polygon[j].weights - polygon[i].weights)
+						};
+					}
+				}
+				if (clippedCount < 3)
+				{
+					return 0;
+				}
+				polygon = clipped;
+				count = clippedCount;
 			}
 
-			// 4-bit subpixel precision.
-			const int p1x = static_cast<int>(std::round(p1.x() * 16.0f));
-			const int p1y = static_cast<int>(std::round(p1.y() * 16.0f));
-			const int p2x = static_cast<int>(std::round(p2.x() * 16.0f));
-			const int p2y = static_cast<int>(std::round(p2.y() * 16.0f));
-			const int p3x = static_cast<int>(std::round(p3.x() * 16.0f));
-			const int p3y = static_cast<int>(std::round(p3.y() * 16.0f));
-
-			const int minX = std::max((std::min(std::min(p1x, p2x), p3x) + 15) >> 4, 0);
-			const int minY = std::max((std::min(std::min(p1y, p2y), p3y) + 15) >> 4, 0);
-			const int maxX = std::min(
-				(std::max(std::max(p1x, p2x), p3x) + 15) >> 4,
-				static_cast<int>(width) - 1
-			);
-			const int maxY = std::min(
-				(std::max(std::max(p1y, p2y), p3y) + 15) >> 4,
-				static_cast<int>(height) - 1
-			);
+			for (std::size_t i = 1; i + 1 < count; i++)
+			{
+				setupTriangle(setups[i - 1], polygon[0], polygon[i], polygon[i + 1]);
+			}
+			return count - 2;
+		}
+		std::size_t setupTriangle(const math::PinholeCamera& camera,
+			const math::Vec3& t1, const math::Vec3& t2, const math::Vec3& t3,
+			std::array<TriangleSetup, maxClippedTriangles>& setups) const
+		{
+			return setupTriangle(camera, transformVertex(camera, t1), transformVertex(camera, t2),
+				transformVertex(camera, t3), setups);
+		}
+
+		// Set up triangles first to last - 1 of a mesh and append the visible ones to setups, in
+		// order. With AVX2, 8 triangles at a time are culled, projected, snapped and get their
+		// plane equations together, and the ones that survive are compacted into setups.
+		// Triangles that need clipping still go through setupTriangle() one at a time. Index is
+		// the type of the vertex indices, which may be 16 or 32 bits wide.
+		template<typename Index>
+		void setupTriangles(const math::PinholeCamera& camera,
+			const std::vector<TransformedVertex>& vertices,
+			const std::vector<std::array<Index, 3>>& triangles, const std::size_t first,
+			const std::size_t last, std::vector<TriangleSetup>& setups) const
+		{
+			std::array<TriangleSetup, maxClippedTriangles> clipped;
+			const auto setupClipped = [&](const std::size_t i)
+			{
+				const std::size_t count = setupTriangle(camera, vertices[triangles[i][0]],
+					vertices[triangles[i][1]], vertices[triangles[i][2]], clipped);
+				for (std::size_t j = 0; j < count; j++)
+				{
+					if (clipped[j].visible)
+					{
+						clipped[j].triangle = static_cast<std::uint32_t>(i);
+						setups.push_back(clipped[j]);
+					}
+				}
+			};
+
+			std::size_t i = first;
+#ifdef __AVX2__
+			static constexpr std::size_t batchSize = 8;
+			using Lanes = std::array<float, batchSize>;
+			using IntLanes = std::array<int, batchSize>;
+
+			// Same planes as in setupTriangle().
+			const float centerX = static_cast<float>(width) / 2.0f;
+			const float centerY = static_cast<float>(height) / 2.0f;
+			const float extent = std::max(std::max(edgePrecision == EdgePrecision::wide ?
+				wideGuardBand : guardBand, centerX), centerY);
+			const __m256 nearPlane = _mm256_set1_ps(-camera.nearDistance / camera.getFocalLength());
+			const __m256 left = _mm256_set1_ps(extent - centerX);
+			const __m256 right = _mm256_set1_ps(extent + centerX);
+			const __m256 top = _mm256_set1_ps(extent - centerY);
+			const __m256 bottom = _mm256_set1_ps(extent + centerY);
+
+			const __m256 zero = _mm256_setzero_ps();
+			const __m256 one = _mm256_set1_ps(1.0f);
+			const __m256i maxX = _mm256_set1_epi32(static_cast<int>(width) - 1);
+			const __m256i maxY = _mm256_set1_epi32(static_cast<int>(height) - 1);
+			// std::round() rounds halfway cases away from zero. Adding the largest float below
+			// 0.5 before truncating does the same.
+			const auto snap = [](const __m256 v)
+			{
+				const __m256 scaled = _mm256_mul_ps(v, _mm256_set1_ps(16.0f));
+				const __m256 half = _mm256_or_ps(_mm256_set1_ps(0.49999997f),
+					_mm256_and_ps(scaled, _mm256_set1_ps(-0.0f)));
+				return _mm256_cvttps_epi32(_mm256_add_ps(scaled, half));
+			};
+			const auto toPixel = [](const __m256i v)
+			{
+				return _mm256_srai_epi32(_mm256_add_epi32(v, _mm256_set1_epi32(15)), 4);
+			};
 
-			const int a1 = p1y - p2y;
-			const int a2 = p2y - p3y;
-			const int a3 = p3y - p1y;
-			const int b1 = p2x - p1x;
-			const int b2 = p3x - p2x;
-			const int b3 = p1x - p3x;
-
-			const int fa1 = a1 << 4;
-			const int fa2 = a2 << 4;
-			const int fa3 = a3 << 4;
-			const int fb1 = b1 << 4;
-			const int fb2 = b2 << 4;
-			const int fb3 = b3 << 4;
-
-			int u1 = b2 * ((minY << 4) - p2y) + a2 * ((minX << 4) - p2x);
-			int u2 = b3 * ((minY << 4) - p3y) + a3 * ((minX << 4) - p3x);
-			int u3 = b1 * ((minY << 4) - p1y) + a1 * ((minX << 4) - p1x);
-
-			const math::Vec3 rc = (math::Mat3(
-				p1.x(), p1.y(), 1.0f,
-				p2.x(), p2.y(), 1.0f,
-				p3.x(), p3.y(), 1.0f
-			).inverse() * math::Vec3(p1.z(), p2.z(), p3.z()));
-			float w = rc.dot({static_cast<float>(minX), static_cast<float>(minY), 1.0f});
-
-			float* zb = zBuffer.data() + minY * width;
-			for (int y = minY; y <= maxY; y++)
+			for (; i + batchSize <= last; i += batchSize)
 			{
-				int v1 = u1;
-				int v2 = u2;
-				int v3 = u3;
-				float z = w;
-				for (int x = minX; x <= maxX; x++)
+				// Vertex k of the triangle in every lane.
+				std::array<std::array<__m256, 3>, 3> view;
+				std::array<std::array<__m256, 3>, 3> q;
+				for (std::size_t k = 0; k < 3; k++)
 				{
-					if ((v1 | v2 | v3) >= 0)
+					alignas(32) std::array<Lanes, 3> viewLanes;
+					alignas(32) std::array<Lanes, 3> qLanes;
+					for (std::size_t lane = 0; lane < batchSize; lane++)
 					{
-						zb[x] = std::max(zb[x], z - math::epsilon);
+						const TransformedVertex& vertex = vertices[triangles[i + lane][k]];
+						for (std::size_t c = 0; c < 3; c++)
+						{
+							viewLanes[c][lane] = vertex.view[c];
+							qLanes[c][lane] = vertex.q[c];
+						}
 					}
+					for (std::size_t c = 0; c < 3; c++)
+					{
+						view[k][c] = _mm256_load_ps(viewLanes[c].data());
+						q[k][c] = _mm256_load_ps(qLanes[c].data());
+					}
+				}
 
-					v1 += fa2;
-					v2 += fa3;
-					v3 += fa1;
-					z += rc[0];
+				// Back-face culling.
+				std::array<__m256, 3> e1;
+				std::array<__m256, 3> e2;
+				for (std::size_t c = 0; c < 3; c++)
+				{
+					e1[c] = _mm256_sub_ps(view[1][c], view[0][c]);
+					e2[c] = _mm256_sub_ps(view[2][c], view[0][c]);
 				}
+				const __m256 nx = _mm256_sub_ps(_mm256_mul_ps(e1[1], e2[2]),
+					_mm256_mul_ps(e1[2], e2[1]));
+				const __m256 ny = _mm256_sub_ps(_mm256_mul_ps(e1[2], e2[0]),
+					_mm256_mul_ps(e1[0], e2[2]));
+				const __m256 nz = _mm256_sub_ps(_mm256_mul_ps(e1[0], e2[1]),
+					_mm256_mul_ps(e1[1], e2[0]));
+				const __m256 facing = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(view[0][0], nx),
+					_mm256_mul_ps(view[0][1], ny)), _mm256_mul_ps(view[0][2], nz));
+				const __m256 front = _mm256_cmp_ps(facing, zero, _CMP_NGE_UQ);
 
-				u1 += fb2;
-				u2 += fb3;
-				u3 += fb1;
-				w += rc[1];
-				zb += width;
+				// Whether every vertex is inside of every plane, so that nothing needs clipping.
+				__m256 inside = front;
+				for (std::size_t k = 0; k < 3; k++)
+				{
+					const std::array<__m256, 5> distances = {
+						_mm256_add_ps(q[k][2], nearPlane),
+						_mm256_add_ps(q[k][0], _mm256_mul_ps(left, q[k][2])),
+						_mm256_sub_ps(_mm256_mul_ps(right, q[k][2]), q[k][0]),
+						_mm256_add_ps(q[k][1], _mm256_mul_ps(top, q[k][2])),
+						_mm256_sub_ps(_mm256_mul_ps(bottom, q[k][2]), q[k][1])
+					};
+					for (const __m256 distance : distances)
+					{
+						inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, zero, _CMP_GE_OQ));
+					}
+				}
+
+				std::array<std::array<__m256, 3>, 3> p;
+				std::array<std::array<__m256i, 2>, 3> fixed;
+				for (std::size_t k = 0; k < 3; k++)
+				{
+					p[k][0] = _mm256_div_ps(q[k][0], q[k][2]);
+					p[k][1] = _mm256_div_ps(q[k][1], q[k][2]);
+					p[k][2] = _mm256_div_ps(one, q[k][2]);
+					fixed[k][0] = snap(p[k][0]);
+					fixed[k][1] = snap(p[k][1]);
+				}
+
+				const __m256i lowX = _mm256_min_epi32(_mm256_min_epi32(fixed[0][0], fixed[1][0]),
+					fixed[2][0]);
+				const __m256i lowY = _mm256_min_epi32(_mm256_min_epi32(fixed[0][1], fixed[1][1]),
+					fixed[2][1]);
+				const __m256i highX = _mm256_max_epi32(_mm256_max_epi32(fixed[0][0], fixed[1][0]),
+					fixed[2][0]);
+				const __m256i highY = _mm256_max_epi32(_mm256_max_epi32(fixed[0][1], fixed[1][1]),
+					fixed[2][1]);
+				const __m256i boundsMinX = _mm256_max_epi32(toPixel(lowX), _mm256_setzero_si256());
+				const __m256i boundsMinY = _mm256_max_epi32(toPixel(lowY), _mm256_setzero_si256());
+				const __m256i boundsMaxX = _mm256_min_epi32(toPixel(highX), maxX);
+				const __m256i boundsMaxY = _mm256_min_epi32(toPixel(highY), maxY);
+				const __m256i empty = _mm256_or_si256(_mm256_cmpgt_epi32(boundsMinX, boundsMaxX),
+					_mm256_cmpgt_epi32(boundsMinY, boundsMaxY));
+
+				const int clippedMask = _mm256_movemask_ps(_mm256_andnot_ps(inside, front));
+				const int visibleMask = _mm256_movemask_ps(_mm256_andnot_ps(
+					_mm256_castsi256_ps(empty), inside));
+				if ((clippedMask | visibleMask) == 0)
+				{
+					continue;
+				}
+
+				// The plane equations, with the inverse written out the same way as
+				// Mat3::inverse() for rows (x, y, 1).
+				const std::array<__m256, 3> x = {p[0][0], p[1][0], p[2][0]};
+				const std::array<__m256, 3> y = {p[0][1], p[1][1], p[2][1]};
+				const __m256 determinant = _mm256_add_ps(_mm256_add_ps(
+					_mm256_mul_ps(x[0], _mm256_sub_ps(y[1], y[2])),
+					_mm256_mul_ps(y[0], _mm256_sub_ps(x[2], x[1]))),
+					_mm256_sub_ps(_mm256_mul_ps(x[1], y[2]), _mm256_mul_ps(y[1], x[2])));
+				const std::array<__m256, 9> inverse = {
+					_mm256_sub_ps(y[1], y[2]),
+					_mm256_sub_ps(y[2], y[0]),
+					_mm256_sub_ps(y[0], y[1]),
+					_mm256_sub_ps(x[2], x[1]),
+					_mm256_sub_ps(x[0], x[2]),
+					_mm256_sub_ps(x[1], x[0]),
+					_mm256_sub_ps(_mm256_mul_ps(x[1], y[2]), _mm256_mul_ps(x[2], y[1])),
+					_mm256_sub_ps(_mm256_mul_ps(x[2], y[0]), _mm256_mul_ps(x[0], y[2])),
+					_mm256_sub_ps(_mm256_mul_ps(x[0], y[1]), _mm256_mul_ps(x[1], y[0]))
+				};
+				alignas(32) std::array<Lanes, 9> inverseLanes;
+				alignas(32) std::array<Lanes, 3> depthLanes;
+				for (std::size_t r = 0; r < 3; r++)
+				{
+					std::array<__m256, 3> row;
+					for (std::size_t c = 0; c < 3; c++)
+					{
+						row[c] = _mm256_div_ps(inverse[r * 3 + c], determinant);
+						_mm256_store_ps(inverseLanes[r * 3 + c].data(), row[c]);
+					}
+					_mm256_store_ps(depthLanes[r].data(), _mm256_add_ps(_mm256_add_ps(
+						_mm256_mul_ps(row[0], p[0][2]), _mm256_mul_ps(row[1], p[1][2])),
+						_mm256_mul_ps(row[2], p[2][2])));
+				}
+
+				// Twice the area, in the same units as the bounding box.
+				const __m256 area = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), _mm256_div_ps(
+					_mm256_sub_ps(
+						_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(fixed[1][0],
+							fixed[0][0])), _mm256_cvtepi32_ps(_mm256_sub_epi32(fixed[2][1],
+							fixed[0][1]))),
+						_mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_sub_epi32(fixed[2][0],
+							fixed[0][0])), _mm256_cvtepi32_ps(_mm256_sub_epi32(fixed[1][1],
+							fixed[0][1])))
+					), _mm256_set1_ps(256.0f)));
+				const __m256i boundsWidth = _mm256_srai_epi32(_mm256_sub_epi32(highX, lowX), 4);
+				const __m256i boundsHeight = _mm256_srai_epi32(_mm256_sub_epi32(highY, lowY), 4);
+				const __m256 spans = _mm256_and_ps(
+					_mm256_castsi256_ps(_mm256_cmpgt_epi32(boundsWidth,
+						_mm256_set1_epi32(blockSize))),
+					_mm256_cmp_ps(area, _mm256_mul_ps(_mm256_set1_ps(spanCoverage * 2.0f),
+						_mm256_cvtepi32_ps(_mm256_mullo_epi32(boundsWidth, boundsHeight))),
+						_CMP_LT_OQ));
+				const int spansMask = _mm256_movemask_ps(spans);
+
+				alignas(32) std::array<std::array<Lanes, 3>, 3> pLanes;
+				alignas(32) std::array<std::array<IntLanes, 2>, 3> fixedLanes;
+				for (std::size_t k = 0; k < 3; k++)
+				{
+					for (std::size_t c = 0; c < 3; c++)
+					{
+						_mm256_store_ps(pLanes[k][c].data(), p[k][c]);
+					}
+					for (std::size_t c = 0; c < 2; c++)
+					{
+						_mm256_store_si256(reinterpret_cast<__m256i*>(fixedLanes[k][c].data()),
+							fixed[k][c]);
+					}
+				}
+				alignas(32) std::array<IntLanes, 4> boundsLanes;
+				_mm256_store_si256(reinterpret_cast<__m256i*>(boundsLanes[0].data()), boundsMinX);
+				_mm256_store_si256(reinterpret_cast<__m256i*>(boundsLanes[1].data()), boundsMinY);
+				_mm256_store_si256(reinterpret_cast<__m256i*>(boundsLanes[2].data()), boundsMaxX);
+				_mm256_store_si256(reinterpret_cast<__m256i*>(boundsLanes[3].data()), boundsMaxY);
+
+				for (std::size_t lane = 0; lane < batchSize; lane++)
+				{
+					if (clippedMask >> lane & 1)
+					{
+						setupClipped(i + lane);
+						continue;
+					}
+					if (!(visibleMask >> lane & 1))
+					{
+						continue;
+					}
+
+					TriangleSetup& setup = setups.emplace_back();
+					setup.p1 = {pLanes[0][0][lane], pLanes[0][1][lane], pLanes[0][2][lane]};
+					setup.p2 = {pLanes[1][0][lane], pLanes[1][1][lane], pLanes[1][2][lane]};
+					setup.p3 = {pLanes[2][0][lane], pLanes[2][1][lane], pLanes[2][2][lane]};
+					setup.p1x = fixedLanes[0][0][lane];
+					setup.p1y = fixedLanes[0][1][lane];
+					setup.p2x = fixedLanes[1][0][lane];
+					setup.p2y = fixedLanes[1][1][lane];
+					setup.p3x = fixedLanes[2][0][lane];
+					setup.p3y = fixedLanes[2][1][lane];
+					setup.minX = boundsLanes[0][lane];
+					setup.minY = boundsLanes[1][lane];
+					setup.maxX = boundsLanes[2][lane];
+					setup.maxY = boundsLanes[3][lane];
+					for (std::size_t r = 0; r < 3; r++)
+					{
+						for (std::size_t c = 0; c < 3; c++)
+						{
+							setup.inverse[r][c] = inverseLanes[r * 3 + c][lane];
+						}
+						setup.depth[r] = depthLanes[r][lane];
+					}
+					// An unclipped triangle is its own source triangle.
+					setup.weights = math::Mat3(
+						1.0f, 0.0f, 0.0f,
+						0.0f, 1.0f, 0.0f,
+						0.0f, 0.0f, 1.0f
+					);
+					setup.interpolation = setup.inverse;
+					setup.minZ = std::min(std::min(setup.p1.z(), setup.p2.z()), setup.p3.z());
+					setup.maxZ = std::max(std::max(setup.p1.z(), setup.p2.z()), setup.p3.z());
+					setup.visible = true;
+					setup.spans = (spansMask >> lane & 1) != 0;
+					setup.wide = edgePrecision == EdgePrecision::wide;
+					setup.triangle = static_cast<std::uint32_t>(i + lane);
+				}
+			}
+#endif
+			for (; i < last; i++)
+			{
+				setupClipped(i);
+			}
+		}
+
+		// Whether the depth test fails for every pixel the triangle covers inside the tile.
+		bool isOccluded(const TriangleSetup& setup, const Tile& tile)
+		{
+			const std::size_t i = getTileIndex(tile.minX, tile.minY);
+			if (tileOutdated[i])
+			{
+				updateTileZ(i);
+			}
+			if (setup.maxZ < tileMinZ[i])
+			{
+				return true;
+			}
+
+			bool occluded = true;
+			forEachBlock(setup, tile, [&](const Block& block)
+				{
+					occluded = occluded && isOccluded(setup, block);
+				}
+			);
+			return occluded;
+		}
+		bool isOccluded(const TriangleSetup& setup, const Block& block) const
+		{
+			return getMaxZ(setup, block) < blockMinZ[getBlockIndex(block.minX, block.minY)];
+		}
+		// Whether the depth test passes for every pixel of the block, which is the case if the
+		// triangle is in front of everything in it.
+		bool isUnoccluded(const TriangleSetup& setup, const Block& block) const
+		{
+			return getMinZ(setup, block) >= blockMaxZ[getBlockIndex(block.minX, block.minY)];
+		}
+
+		// Only affect the z-buffer. Pixels outside of the tile are left alone.
+		void prerenderTriangle(const TriangleSetup& setup, const Tile& tile)
+		{
+			rasterizeDepth<false>(setup, tile, noTriangle, nullptr);
+		}
+		// Also write the index of the triangle into the tile's visibility buffer wherever the
+		// triangle ends up in front. The visibility buffer is tileSize pixels wide.
+		void prerenderTriangle(const TriangleSetup& setup, const Tile& tile,
+			const std::uint32_t triangle, std::uint32_t* visibility)
+		{
+			rasterizeDepth<true>(setup, tile, triangle, visibility);
+		}
+		void prerenderTriangle(const math::PinholeCamera& camera,
+			const math::Vec3& t1, const math::Vec3& t2, const math::Vec3& t3)
+		{
+			// The triangle still gets split up into tiles so that the result is identical to the
+			// tiled renderer in TriangleMesh.
+			std::array<TriangleSetup, maxClippedTriangles> setups;
+			const std::size_t count = setupTriangle(camera, t1, t2, t3, setups);
+			for (std::size_t i = 0; i < count; i++)
+			{
+				if (setups[i].visible)
+				{
+					forEachTile(setups[i], [this, &setups, i](const std::size_t, const Tile& tile)
+						{
+							prerenderTriangle(setups[i], tile);
+						}
+					);
+				}
 			}
 		}
-		void renderTriangle(const math::PinholeCamera& camera,
+		void renderTriangle(const TriangleSetup& setup, const Tile& tile,
+			const RenderContext& context,
+			const math::Vec4& c1, const math::Vec4& c2, const math::Vec4& c3,
+			const math::Vec3& n1, const math::Vec3& n2, const math::Vec3& n3,
+			const Material& material);
+		void renderTriangle(const TriangleSetup& setup, const Tile& tile,
+			const RenderContext& context, const Framebuffer& texture,
+			const math::Vec3& t1, const math::Vec3& t2, const math::Vec3& t3,
+			const math::Vec2& r1, const math::Vec2& r2, const math::Vec2& r3,
+			const math::Vec3& n1, const math::Vec3& n2, const math::Vec3& n3,
+			const Material& material);
+		void renderTriangle(const RenderContext& context,
 			const math::Vec3& t1, const math::Vec3& t2, const math::Vec3& t3,
 			const math::Vec4& c1, const math::Vec4& c2, const math::Vec4& c3,
 			const math::Vec3& n1, const math::Vec3& n2, const math::Vec3& n3,
-			std::vector<DirectionalLight>& directionalLights, std::vector<PointLight>& pointLights,
 			const Material& material);
-		void renderTriangle(const math::PinholeCamera& camera, const Framebuffer& texture,
+		void renderTriangle(const RenderContext& context, const Framebuffer& texture,
 			const math::Vec3& t1, const math::Vec3& t2, const math::Vec3& t3,
 			const math::Vec2& r1, const math::Vec2& r2, const math::Vec2& r3,
 			const math::Vec3& n1, const math::Vec3& n2, const math::Vec3& n3,
-			std::vector<DirectionalLight>& directionalLights, std::vector<PointLight>& pointLights,
 			const Material& material);
+		// Shade every pixel of the tile that the visibility buffer assigns to a triangle of the
+		// mesh, using the setups the visibility buffer was rendered with.
+		void resolveVisibility(const Tile& tile, const std::uint32_t* visibility,
+			const TriangleMesh& mesh, const DrawParameters& draw,
+			const std::vector<TriangleSetup>& setups, const RenderContext& context);
 
 		void blit() const
 		{
@@ -323,6 +1326,16 @@ export namespace graphics
 		{
 			return height;
 		}
+		EdgePrecision getEdgePrecision() const
+		{
+			return edgePrecision;
+		}
+		// Wide edge functions are picked by default for framebuffers that are too large for
+		// narrow ones.
+		void setEdgePrecision(const EdgePrecision edgePrecision)
+		{
+			this->edgePrecision = edgePrecision;
+		}
 
 		void saveTIFF(const std::string& filename)
 		{
@@ -0,0 +1,158 @@
+module;
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+export module graphics:MappedFile;
+
+import <string>;
+import <stdexcept>;
+import <utility>;
+import <cstddef>;
+
+export namespace graphics
+{
+	// A whole file mapped read-only into memory. Pages are only read from disk once they are
+	// touched, and nothing gets copied into a buffer of our own.
+	class MappedFile
+	{
+		const std::byte* data;
+		std::size_t size;
+#ifdef _WIN32
+		HANDLE file;
+		HANDLE mapping;
+#else
+		int file;
+#endif
+
+		void close()
+		{
+#ifdef _WIN32
+			if (data)
+			{
+				UnmapViewOfFile(data);
+			}
+			if (mapping)
+			{
+				CloseHandle(mapping);
+			}
+			if (file != INVALID_HANDLE_VALUE)
+			{
+				CloseHandle(file);
+			}
+			file = INVALID_HANDLE_VALUE;
+			mapping = nullptr;
+#else
+			if (data)
+			{
+				munmap(const_cast<std::byte*>(data), size);
+			}
+			if (file >= 0)
+			{
+				::close(file);
+			}
+			file = -1;
+#endif
+			data = nullptr;
+			size = 0;
+		}
+
+	public:
+		explicit MappedFile(const std::string& filename) : data(nullptr), size(0)
+		{
+			const auto fail = [&]()
+			{
+				close();
+				throw std::runtime_error("Couldn't map file '" + filename + "' for reading!");
+			};
+#ifdef _WIN32
+			mapping = nullptr;
+			file = CreateFileA(filename.c_str(), GENERIC_READ, FILE_SHARE_READ, nullptr,
+				OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL | FILE_FLAG_SEQUENTIAL_SCAN, nullptr);
+			LARGE_INTEGER fileSize;
+			if (file == INVALID_HANDLE_VALUE || !GetFileSizeEx(file, &fileSize))
+			{
+				fail();
+			}
+			size = static_cast<std::size_t>(fileSize.QuadPart);
+			if (size == 0)
+			{
+				return;
+			}
+			mapping = CreateFileMappingA(file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+			if (mapping)
+			{
+				data = static_cast<const std::byte*>(MapViewOfFile(mapping, FILE_MAP_READ, 0, 0,
+					0));
+			}
+#else
+			file = open(filename.c_str(), O_RDONLY);
+			struct stat status;
+			if (file < 0 || fstat(file, &status) != 0)
+			{
+				fail();
+			}
+			size = static_cast<std::size_t>(status.st_size);
+			if (size == 0)
+			{
+				return;
+			}
+			void* mapped = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, file, 0);
+			if (mapped != MAP_FAILED)
+			{
+				data = static_cast<const std::byte*>(mapped);
+			}
+#endif
+			if (!data)
+			{
+				fail();
+			}
+		}
+		MappedFile(const MappedFile&) = delete;
+		MappedFile& operator=(const MappedFile&) = delete;
+		MappedFile(MappedFile&& other) noexcept : data(std::exchange(other.data, nullptr)),
+			size(std::exchange(other.size, 0)),
+#ifdef _WIN32
+			file(std::exchange(other.file, INVALID_HANDLE_VALUE)),
+			mapping(std::exchange(other.mapping, nullptr)) {}
+#else
+			file(std::exchange(other.file, -1)) {}
+#endif
+		MappedFile& operator=(MappedFile&& other) noexcept
+		{
+			if (this != &other)
+			{
+				close();
+				data = std::exchange(other.data, nullptr);
+				size = std::exchange(other.size, 0);
+#ifdef _WIN32
+				file = std::exchange(other.file, INVALID_HANDLE_VALUE);
+				mapping = std::exchange(other.mapping, nullptr);
+#else
+				file = std::exchange(other.file, -1);
+#endif
+			}
+			return *this;
+		}
+		~MappedFile()
+		{
+			close();
+		}
+
+		const std::byte* getData() const
+		{
+			return data;
+		}
+		std::size_t getSize() const
+		{
+			return size;
+		}
+	};
+}
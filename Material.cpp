@@ -21,13 +21,15 @@ export namespace graphics
 		float kX;
 		float kR;
 		float kF;
+
+		bool operator==(const Material&) const = default;
 	};
 
-	Material flat = {0.01f, 0.0f, 0u, 3.0f, 1.0f, 0.0f, 0.0f};
-	Material mixed = {0.01f, 0.1f, 10u, 3.0f, 1.0f, 0.0f, 0.0f};
-	Material shiny = {0.01f, 1.0f, 100u, 3.0f, 1.0f, 0.0f, 0.0f};
-	Material reflective = {0.01f, 1.0f, 100u, 3.0f, 1.0f, 0.5f, 0.5f};
-	Material chrome = {0.0f, 0.0f, 0u, 0.0f, 0.0f, 1.0f, 0.0f};
-	Material specularChrome = {0.0f, 1.0f, 100u, 0.0f, 0.0f, 1.0f, 0.0f};
-	Material defaultMaterial = mixed;
+	constexpr Material flat = {0.01f, 0.0f, 0u, 3.0f, 1.0f, 0.0f, 0.0f};
+	constexpr Material mixed = {0.01f, 0.1f, 10u, 3.0f, 1.0f, 0.0f, 0.0f};
+	constexpr Material shiny = {0.01f, 1.0f, 100u, 3.0f, 1.0f, 0.0f, 0.0f};
+	constexpr Material reflective = {0.01f, 1.0f, 100u, 3.0f, 1.0f, 0.5f, 0.5f};
+	constexpr Material chrome = {0.0f, 0.0f, 0u, 0.0f, 0.0f, 1.0f, 0.0f};
+	constexpr Material specularChrome = {0.0f, 1.0f, 100u, 0.0f, 0.0f, 1.0f, 0.0f};
+	constexpr Material defaultMaterial = mixed;
 }
@@ -0,0 +1,209 @@
+export module graphics:MeshConverter;
+
+import :TriangleMesh;
+import :MeshFile;
+import :Quantization;
+import :MeshOptimization;
+
+import math;
+
+import <array>;
+import <vector>;
+import <string>;
+import <fstream>;
+import <stdexcept>;
+import <algorithm>;
+import <cmath>;
+import <cstdint>;
+import <cstddef>;
+
+namespace graphics
+{
+	// Writes a stream at the next aligned offset and records that offset in the header.
+	class MeshFileWriter
+	{
+		std::ofstream file;
+		std::uint64_t offset;
+
+	public:
+		explicit MeshFileWriter(const std::string& filename) :
+			file(filename, std::ios::binary), offset(0)
+		{
+			if (file.fail())
+			{
+				throw std::runtime_error("Couldn't open file '" + filename + "' for writing!");
+			}
+		}
+
+		void write(const void* data, const std::size_t size)
+		{
+			file.write(static_cast<const char*>(data), static_cast<std::streamsize>(size));
+			offset += size;
+		}
+		template<typename T>
+		void writeStream(MeshFileHeader& header, const MeshFileStream stream,
+			const std::vector<T>& elements)
+		{
+			if (elements.empty())
+			{
+				return;
+			}
+			static constexpr std::array<char, meshFileAlignment> padding{};
+			write(padding.data(), (meshFileAlignment - offset % meshFileAlignment) %
+				meshFileAlignment);
+			header.offsets[stream] = offset;
+			write(elements.data(), elements.size() * sizeof(T));
+		}
+		// The header is written first as a placeholder, and again once the offsets are known.
+		void finish(const MeshFileHeader& header)
+		{
+			file.seekp(0);
+			file.write(reinterpret_cast<const char*>(&header), sizeof(MeshFileHeader));
+			if (file.fail())
+			{
+				throw std::runtime_error("Couldn't write mesh file!");
+			}
+		}
+	};
+}
+
+export namespace graphics
+{
+	struct MeshFileOptions
+	{
+		bool quantizePositions = true;
+		bool octahedralNormals = true;
+	};
+
+	// Write the mesh in the .mesh format described in MeshFile.cpp. Indices are stored in 16
+	// bits whenever the mesh has few enough vertices. The meshlets and bounds are stored as
+	// they are, so build the meshlets first if they should be part of the file.
+	void writeMeshFile(const TriangleMesh& mesh, const std::string& filename,
+		const MeshFileOptions& options = MeshFileOptions())
+	{
+		if (mesh.isCompressed())
+		{
+			TriangleMesh decompressed = mesh;
+			decompressed.decompress();
+			writeMeshFile(decompressed, filename, options);
+			return;
+		}
+
+		MeshFileHeader header{};
+		header.magic = meshFileMagic;
+		header.version = meshFileVersion;
+		header.vertexCount = static_cast<std::uint32_t>(mesh.vertices.size());
+		header.triangleCount = static_cast<std::uint32_t>(mesh.triangles.size());
+		header.meshletCount = static_cast<std::uint32_t>(mesh.meshlets.size());
+		for (std::size_t i = 0; i < 3; i++)
+		{
+			header.minimum[i] = mesh.bounds.minimum[i];
+			header.maximum[i] = mesh.bounds.maximum[i];
+			header.center[i] = mesh.bounds.center[i];
+		}
+		// Quantized positions move by up to half a step along every axis, so the bounding
+		// spheres and the boxes of the meshlets grow by that much to stay conservative.
+		const float quantizationError = options.quantizePositions && !mesh.bounds.isEmpty() ?
+			(mesh.bounds.maximum - mesh.bounds.minimum).norm() / (2.0f * 65535.0f) : 0.0f;
+		header.radius = mesh.bounds.radius + quantizationError;
+		if (options.quantizePositions)
+		{
+			header.flags |= MeshFileFlags::quantizedPositions;
+		}
+		if (options.octahedralNormals)
+		{
+			header.flags |= MeshFileFlags::octahedralNormals;
+		}
+		if (mesh.vertices.size() <= 65536)
+		{
+			header.flags |= MeshFileFlags::shortIndices;
+		}
+
+		MeshFileWriter writer(filename);
+		writer.write(&header, sizeof(MeshFileHeader));
+
+		if (options.quantizePositions)
+		{
+			std::vector<std::array<std::uint16_t, 3>> positions(mesh.vertices.size());
+			for (std::size_t i = 0; i < positions.size(); i++)
+			{
+				for (std::size_t k = 0; k < 3; k++)
+				{
+					const float extent = header.maximum[k] - header.minimum[k];
+					const float t = extent > 0.0f ?
+						(mesh.vertices[i][k] - header.minimum[k]) / extent : 0.0f;
+					positions[i][k] = static_cast<std::uint16_t>(
+						std::round(std::clamp(t, 0.0f, 1.0f) * 65535.0f));
+				}
+			}
+			writer.writeStream(header, positionStream, positions);
+		}
+		else
+		{
+			writer.writeStream(header, positionStream, mesh.vertices);
+		}
+		writer.writeStream(header, colorStream, mesh.colors);
+		if (options.octahedralNormals)
+		{
+			std::vector<std::array<std::int16_t, 2>> normals(mesh.normals.size());
+			for (std::size_t i = 0; i < normals.size(); i++)
+			{
+				normals[i] = encodeOctahedral(mesh.normals[i]);
+			}
+			writer.writeStream(header, normalStream, normals);
+		}
+		else
+		{
+			writer.writeStream(header, normalStream, mesh.normals);
+		}
+		writer.writeStream(header, textureCoordinateStream, mesh.textureCoordinates);
+		if (header.flags & MeshFileFlags::shortIndices)
+		{
+			std::vector<std::array<std::uint16_t, 3>> indices(mesh.triangles.size());
+			for (std::size_t i = 0; i < indices.size(); i++)
+			{
+				for (std::size_t k = 0; k < 3; k++)
+				{
+					indices[i][k] = static_cast<std::uint16_t>(mesh.triangles[i][k]);
+				}
+			}
+			writer.writeStream(header, indexStream, indices);
+		}
+		else
+		{
+			writer.writeStream(header, indexStream, mesh.triangles);
+		}
+
+		std::vector<MeshletRecord> meshlets(mesh.meshlets.size());
+		for (std::size_t i = 0; i < meshlets.size(); i++)
+		{
+			const Meshlet& meshlet = mesh.meshlets[i];
+			MeshletRecord& record = meshlets[i];
+			record.firstTriangle = static_cast<std::uint32_t>(meshlet.firstTriangle);
+			record.triangleCount = static_cast<std::uint32_t>(meshlet.triangleCount);
+			for (std::size_t k = 0; k < 3; k++)
+			{
+				record.minimum[k] = meshlet.bounds.minimum[k] - quantizationError;
+				record.maximum[k] = meshlet.bounds.maximum[k] + quantizationError;
+				record.center[k] = meshlet.bounds.center[k];
+				record.coneAxis[k] = meshlet.coneAxis[k];
+			}
+			record.radius = meshlet.bounds.radius + quantizationError;
+			record.coneCutoff = meshlet.coneCutoff;
+		}
+		writer.writeStream(header, meshletStream, meshlets);
+		writer.finish(header);
+	}
+
+	// Convert a .bin file to a .mesh file, optimizing the mesh and building its meshlets on the
+	// way.
+	void convertBinToMeshFile(const std::string& binFilename, const std::string& meshFilename,
+		const MeshFileOptions& options = MeshFileOptions())
+	{
+		TriangleMesh mesh;
+		mesh.addBin(binFilename);
+		optimizeMesh(mesh);
+		mesh.buildMeshlets();
+		writeMeshFile(mesh, meshFilename, options);
+	}
+}
@@ -0,0 +1,231 @@
+export module graphics:MeshFile;
+
+import :MappedFile;
+import :Quantization;
+
+import math;
+
+import <array>;
+import <bit>;
+import <span>;
+import <string>;
+import <stdexcept>;
+import <cstring>;
+import <cstdint>;
+import <cstddef>;
+
+// The streams are mapped and written as they are, so only little-endian hosts can use them.
+static_assert(std::endian::native == std::endian::little);
+
+export namespace graphics
+{
+	// A .mesh file starts with a MeshFileHeader, followed by one stream per attribute. Every
+	// stream starts at a multiple of meshFileAlignment bytes, and the header records where. A
+	// stream that is absent has an offset of 0. Everything is little-endian.
+	//
+	// - Positions are 3 floats, or with MeshFileFlags::quantizedPositions 3 uint16s that map the
+	//   bounding box of the mesh onto [0, 65535].
+	// - Colors are 4 floats.
+	// - Normals are 3 floats, or with MeshFileFlags::octahedralNormals 2 int16s holding the
+	//   octahedral encoding of the normal.
+	// - Texture coordinates are 2 floats.
+	// - Indices are 3 uint32s per triangle, or with MeshFileFlags::shortIndices 3 uint16s.
+	// - Meshlets are MeshletRecords, with their triangles in the order the meshlets list them.
+	constexpr std::array<char, 4> meshFileMagic = {'M', 'E', 'S', 'H'};
+	constexpr std::uint32_t meshFileVersion = 1;
+	constexpr std::size_t meshFileAlignment = 64;
+
+	namespace MeshFileFlags
+	{
+		constexpr std::uint32_t quantizedPositions = 1;
+		constexpr std::uint32_t octahedralNormals = 2;
+		constexpr std::uint32_t shortIndices = 4;
+	}
+
+	enum MeshFileStream
+	{
+		positionStream,
+		colorStream,
+		normalStream,
+		textureCoordinateStream,
+		indexStream,
+		meshletStream,
+		meshFileStreamCount
+	};
+
+	struct MeshFileHeader
+	{
+		std::array<char, 4> magic;
+		std::uint32_t version;
+		std::uint32_t flags;
+		std::uint32_t vertexCount;
+		std::uint32_t triangleCount;
+		std::uint32_t meshletCount;
+		std::array<float, 3> minimum;
+		std::array<float, 3> maximum;
+		std::array<float, 3> center;
+		float radius;
+		std::array<std::uint64_t, meshFileStreamCount> offsets;
+	};
+
+	struct MeshletRecord
+	{
+		std::uint32_t firstTriangle;
+		std::uint32_t triangleCount;
+		std::array<float, 3> minimum;
+		std::array<float, 3> maximum;
+		std::array<float, 3> center;
+		float radius;
+		std::array<float, 3> coneAxis;
+		float coneCutoff;
+	};
+
+	// A .mesh file, mapped into memory and checked. The streams are views into the mapping and
+	// stay valid for as long as the MeshFile does. Only the streams that the flags select are
+	// non-empty, so e.g. exactly one of positions and quantizedPositions is.
+	class MeshFile
+	{
+		MappedFile file;
+
+	public:
+		MeshFileHeader header;
+		std::span<const math::Vec3> positions;
+		std::span<const std::array<std::uint16_t, 3>> quantizedPositions;
+		std::span<const math::Vec4> colors;
+		std::span<const math::Vec3> normals;
+		std::span<const std::array<std::int16_t, 2>> octahedralNormals;
+		std::span<const math::Vec2> textureCoordinates;
+		std::span<const std::array<std::uint32_t, 3>> indices;
+		std::span<const std::array<std::uint16_t, 3>> shortIndices;
+		std::span<const MeshletRecord> meshlets;
+
+		explicit MeshFile(const std::string& filename) : file(filename)
+		{
+			const auto fail = [&](const std::string& problem)
+			{
+				throw std::runtime_error(problem + " in file '" + filename + "'!");
+			};
+			if (file.getSize() < sizeof(MeshFileHeader))
+			{
+				fail("Header is cut off");
+			}
+			std::memcpy(&header, file.getData(), sizeof(MeshFileHeader));
+			if (header.magic != meshFileMagic)
+			{
+				fail("Invalid header");
+			}
+			if (header.version != meshFileVersion)
+			{
+				fail("Unsupported version " + std::to_string(header.version));
+			}
+
+			const auto view = [&]<typename T>(std::span<const T>& span,
+				const MeshFileStream stream, const std::size_t count, const char* what)
+			{
+				const std::uint64_t offset = header.offsets[stream];
+				if (offset == 0)
+				{
+					return;
+				}
+				if (offset % meshFileAlignment != 0 || offset > file.getSize() ||
+					count * sizeof(T) > file.getSize() - offset)
+				{
+					fail(std::string(what) + " is cut off or misaligned");
+				}
+				span = {reinterpret_cast<const T*>(file.getData() + offset), count};
+			};
+			const std::size_t vertexCount = header.vertexCount;
+			const std::size_t triangleCount = header.triangleCount;
+			if (header.flags & MeshFileFlags::quantizedPositions)
+			{
+				view(quantizedPositions, positionStream, vertexCount, "Position data");
+			}
+			else
+			{
+				view(positions, positionStream, vertexCount, "Position data");
+			}
+			if (header.offsets[positionStream] == 0 && vertexCount > 0)
+			{
+				fail("Position data not found");
+			}
+			view(colors, colorStream, vertexCount, "Color data");
+			if (header.flags & MeshFileFlags::octahedralNormals)
+			{
+				view(octahedralNormals, normalStream, vertexCount, "Normal data");
+			}
+			else
+			{
+				view(normals, normalStream, vertexCount, "Normal data");
+			}
+			view(textureCoordinates, textureCoordinateStream, vertexCount,
+				"Texture coordinate data");
+			if (header.flags & MeshFileFlags::shortIndices)
+			{
+				view(shortIndices, indexStream, triangleCount, "Index data");
+			}
+			else
+			{
+				view(indices, indexStream, triangleCount, "Index data");
+			}
+			view(meshlets, meshletStream, header.meshletCount, "Meshlet data");
+
+			const auto checkIndices = [&](const auto& triangles)
+			{
+				for (const auto& triangle : triangles)
+				{
+					if (triangle[0] >= vertexCount || triangle[1] >= vertexCount ||
+						triangle[2] >= vertexCount)
+					{
+						fail("Index data refers to a vertex that doesn't exist");
+					}
+				}
+			};
+			checkIndices(indices);
+			checkIndices(shortIndices);
+			if (indices.size() + shortIndices.size() != triangleCount)
+			{
+				fail("Index data not found");
+			}
+			for (const MeshletRecord& meshlet : meshlets)
+			{
+				if (meshlet.firstTriangle > triangleCount ||
+					meshlet.triangleCount > triangleCount - meshlet.firstTriangle)
+				{
+					fail("Meshlet data refers to a triangle that doesn't exist");
+				}
+			}
+		}
+
+		math::Vec3 getPosition(const std::size_t i) const
+		{
+			if (!positions.empty())
+			{
+				return positions[i];
+			}
+			const std::array<std::uint16_t, 3>& q = quantizedPositions[i];
+			math::Vec3 position;
+			for (std::size_t k = 0; k < 3; k++)
+			{
+				position[k] = header.minimum[k] +
+					(header.maximum[k] - header.minimum[k]) * (q[k] / 65535.0f);
+			}
+			return position;
+		}
+		math::Vec3 getNormal(const std::size_t i) const
+		{
+			return normals.empty() ? decodeOctahedral(octahedralNormals[i]) : normals[i];
+		}
+		bool hasNormals() const
+		{
+			return !normals.empty() || !octahedralNormals.empty();
+		}
+		std::array<unsigned int, 3> getTriangle(const std::size_t i) const
+		{
+			if (!indices.empty())
+			{
+				return {indices[i][0], indices[i][1], indices[i][2]};
+			}
+			return {shortIndices[i][0], shortIndices[i][1], shortIndices[i][2]};
+		}
+	};
+}
@@ -0,0 +1,915 @@
+export module graphics:MeshImport;
+
+import :MappedFile;
+import :ThreadPool;
+
+import math;
+
+import <array>;
+import <vector>;
+import <string>;
+import <string_view>;
+import <unordered_map>;
+import <functional>;
+import <exception>;
+import <stdexcept>;
+import <algorithm>;
+import <charconv>;
+import <cmath>;
+import <cstring>;
+import <cstdint>;
+import <cstddef>;
+
+namespace graphics
+{
+	// Run task(i) for every chunk on the thread pool. An exception can't leave a task, so
+	// each chunk keeps its own, and the first one gets rethrown once every chunk is done.
+	void parallelChunks(const std::size_t count, const std::function<void(std::size_t)>& task)
+	{
+		std::vector<std::exception_ptr> errors(count);
+		getThreadPool().parallelFor(count, [&](const std::size_t i)
+			{
+				try
+				{
+					task(i);
+				}
+				catch (...)
+				{
+					errors[i] = std::current_exception();
+				}
+			}
+		);
+		for (const std::exception_ptr& error : errors)
+		{
+			if (error)
+			{
+				std::rethrow_exception(error);
+			}
+		}
+	}
+
+	bool isSpace(const char c)
+	{
+		return c == ' ' || c == '\t' || c == '\r';
+	}
+	const char* skipSpaces(const char* p, const char* end)
+	{
+		while (p < end && isSpace(*p))
+		{
+			p++;
+		}
+		return p;
+	}
+	const char* findLineEnd(const char* p, const char* end)
+	{
+		const void* newline = std::memchr(p, '\n', static_cast<std::size_t>(end - p));
+		return newline ? static_cast<const char*>(newline) : end;
+	}
+
+	template<typename T>
+	bool parseNumber(const char*& p, const char* end, T& value)
+	{
+		p = skipSpaces(p, end);
+		if (p < end && *p == '+')
+		{
+			p++;
+		}
+		const std::from_chars_result result = std::from_chars(p, end, value);
+		if (result.ec != std::errc())
+		{
+			return false;
+		}
+		p = result.ptr;
+		return true;
+	}
+
+	// Split [begin, end) into about count pieces that each end right after a newline.
+	std::vector<const char*> splitLines(const char* begin, const char* end,
+		const std::size_t count)
+	{
+		std::vector<const char*> bounds = {begin};
+		const std::size_t size = static_cast<std::size_t>(end - begin);
+		for (std::size_t i = 1; i < count; i++)
+		{
+			const char* p = std::max(begin + size * i / count, bounds.back());
+			p = findLineEnd(p, end);
+			bounds.push_back(p < end ? p + 1 : end);
+		}
+		bounds.push_back(end);
+		return bounds;
+	}
+
+	std::size_t getChunkCount(const std::size_t size)
+	{
+		static constexpr std::size_t minChunkSize = 1 << 20;
+		return std::clamp<std::size_t>(size / minChunkSize, 1,
+			getThreadPool().getThreadCount() * 4);
+	}
+
+	enum class ObjIndexKind : std::uint8_t
+	{
+		none,
+		absolute,
+		// Counted from the start of the chunk, since the chunks before it are still being parsed.
+		relative
+	};
+
+	struct ObjIndex
+	{
+		std::int64_t value = 0;
+		ObjIndexKind kind = ObjIndexKind::none;
+	};
+
+	struct ObjCorner
+	{
+		std::array<ObjIndex, 3> indices;
+	};
+
+	// Everything a chunk of an OBJ file declares, with the polygons already split into
+	// triangles.
+	struct ObjChunk
+	{
+		std::vector<math::Vec3> positions;
+		std::vector<math::Vec3> colors;
+		std::vector<math::Vec2> textureCoordinates;
+		std::vector<math::Vec3> normals;
+		std::vector<std::array<ObjCorner, 3>> triangles;
+		bool hasColors = false;
+	};
+
+	void parseObjChunk(const char* begin, const char* end, ObjChunk& chunk,
+		const std::string& filename)
+	{
+		const auto fail = [&]()
+		{
+			throw std::runtime_error("Malformed line in file '" + filename + "'!");
+		};
+		std::vector<ObjCorner> polygon;
+		for (const char* line = begin; line < end;)
+		{
+			const char* lineEnd = findLineEnd(line, end);
+			const char* p = skipSpaces(line, lineEnd);
+			const std::size_t keywordLength = static_cast<std::size_t>(std::find_if(p, lineEnd,
+				isSpace) - p);
+			const std::string_view keyword(p, keywordLength);
+			p += keywordLength;
+
+			if (keyword == "v")
+			{
+				// Some exporters append a vertex color to the position.
+				std::array<float, 6> values;
+				std::size_t count = 0;
+				while (count < values.size() && parseNumber(p, lineEnd, values[count]))
+				{
+					count++;
+				}
+				if (count < 3)
+				{
+					fail();
+				}
+				chunk.positions.push_back({values[0], values[1], values[2]});
+				if (count == 6)
+				{
+					chunk.colors.push_back({values[3], values[4], values[5]});
+					chunk.hasColors = true;
+				}
+				else
+				{
+					chunk.colors.push_back(math::Vec3(1.0f));
+				}
+			}
+			else if (keyword == "vt")
+			{
+				math::Vec2 r = math::Vec2(0.0f);
+				if (!parseNumber(p, lineEnd, r[0]))
+				{
+					fail();
+				}
+				parseNumber(p, lineEnd, r[1]);
+				chunk.textureCoordinates.push_back(r);
+			}
+			else if (keyword == "vn")
+			{
+				math::Vec3 normal;
+				for (std::size_t k = 0; k < 3; k++)
+				{
+					if (!parseNumber(p, lineEnd, normal[k]))
+					{
+						fail();
+					}
+				}
+				chunk.normals.push_back(normal);
+			}
+			else if (keyword == "f")
+			{
+				const std::array<std::size_t, 3> counts = {chunk.positions.size(),
+					chunk.textureCoordinates.size(), chunk.normals.size()};
+				polygon.clear();
+				while (true)
+				{
+					ObjCorner corner;
+					for (std::size_t k = 0; k < 3; k++)
+					{
+						if (k > 0)
+						{
+							if (p == lineEnd || *p != '/')
+							{
+								break;
+							}
+							p++;
+							if (p < lineEnd && *p == '/')
+							{
+								continue;
+							}
+						}
+						std::int64_t value;
+						if (!parseNumber(p, lineEnd, value))
+						{
+							if (k == 0)
+							{
+								break;
+							}
+							fail();
+						}
+						if (value == 0)
+						{
+							fail();
+						}
+						corner.indices[k] = value > 0 ?
+							ObjIndex{value - 1, ObjIndexKind::absolute} :
+							ObjIndex{static_cast<std::int64_t>(counts[k]) + value,
+								ObjIndexKind::relative};
+					}
+					if (corner.indices[0].kind == ObjIndexKind::none)
+					{
+						break;
+					}
+					polygon.push_back(corner);
+				}
+				if (polygon.size() < 3 || skipSpaces(p, lineEnd) != lineEnd)
+				{
+					fail();
+				}
+				for (std::size_t i = 1; i + 1 < polygon.size(); i++)
+				{
+					chunk.triangles.push_back({polygon[0], polygon[i], polygon[i + 1]});
+				}
+			}
+			line = lineEnd + 1;
+		}
+	}
+
+	struct VertexTupleHash
+	{
+		std::size_t operator()(const std::array<std::int64_t, 3>& tuple) const
+		{
+			return std::hash<std::int64_t>()(tuple[0]) * 31 * 31 +
+				std::hash<std::int64_t>()(tuple[1]) * 31 + std::hash<std::int64_t>()(tuple[2]);
+		}
+	};
+
+	enum class PlyFormat
+	{
+		ascii,
+		binaryLittleEndian,
+		binaryBigEndian
+	};
+
+	enum class PlyType
+	{
+		int8,
+		uint8,
+		int16,
+		uint16,
+		int32,
+		uint32,
+		float32,
+		float64
+	};
+
+	struct PlyProperty
+	{
+		std::string name;
+		PlyType type;
+		bool isList = false;
+		PlyType countType = PlyType::uint8;
+	};
+
+	struct PlyElement
+	{
+		std::string name;
+		std::size_t count = 0;
+		std::vector<PlyProperty> properties;
+	};
+
+	PlyType parsePlyType(const std::string_view name, const std::string& filename)
+	{
+		static constexpr std::array<std::pair<std::string_view, PlyType>, 16> types = {{
+			{"char", PlyType::int8}, {"int8", PlyType::int8},
+			{"uchar", PlyType::uint8}, {"uint8", PlyType::uint8},
+			{"short", PlyType::int16}, {"int16", PlyType::int16},
+			{"ushort", PlyType::uint16}, {"uint16", PlyType::uint16},
+			{"int", PlyType::int32}, {"int32", PlyType::int32},
+			{"uint", PlyType::uint32}, {"uint32", PlyType::uint32},
+			{"float", PlyType::float32}, {"float32", PlyType::float32},
+			{"double", PlyType::float64}, {"float64", PlyType::float64}
+		}};
+		for (const auto& [typeName, type] : types)
+		{
+			if (name == typeName)
+			{
+				return type;
+			}
+		}
+		throw std::runtime_error("Unknown property type '" + std::string(name) + "' in file '" +
+			filename + "'!");
+	}
+
+	std::size_t getSize(const PlyType type)
+	{
+		switch (type)
+		{
+		case PlyType::int8:
+		case PlyType::uint8:
+			return 1;
+		case PlyType::int16:
+		case PlyType::uint16:
+			return 2;
+		case PlyType::int32:
+		case PlyType::uint32:
+		case PlyType::float32:
+			return 4;
+		default:
+			return 8;
+		}
+	}
+
+	// Colors stored as integers span the range from 0 to the maximum of their type, and
+	// negative values of signed types are clamped to 0.
+	double toColorComponent(const double value, const PlyType type)
+	{
+		switch (type)
+		{
+		case PlyType::int8:
+			return std::max(value, 0.0) / 127.0;
+		case PlyType::uint8:
+			return value / 255.0;
+		case PlyType::int16:
+			return std::max(value, 0.0) / 32767.0;
+		case PlyType::uint16:
+			return value / 65535.0;
+		case PlyType::int32:
+			return std::max(value, 0.0) / 2147483647.0;
+		case PlyType::uint32:
+			return value / 4294967295.0;
+		default:
+			return value;
+		}
+	}
+
+	template<typename T>
+	double readAs(const std::byte* p, const bool bigEndian)
+	{
+		std::array<std::byte, sizeof(T)> bytes;
+		std::memcpy(bytes.data(), p, sizeof(T));
+		if (bigEndian)
+		{
+			std::reverse(bytes.begin(), bytes.end());
+		}
+		T value;
+		std::memcpy(&value, bytes.data(), sizeof(T));
+		return static_cast<double>(value);
+	}
+	double readPlyValue(const std::byte* p, const PlyType type, const bool bigEndian)
+	{
+		switch (type)
+		{
+		case PlyType::int8:
+			return readAs<std::int8_t>(p, bigEndian);
+		case PlyType::uint8:
+			return readAs<std::uint8_t>(p, bigEndian);
+		case PlyType::int16:
+			return readAs<std::int16_t>(p, bigEndian);
+		case PlyType::uint16:
+			return readAs<std::uint16_t>(p, bigEndian);
+		case PlyType::int32:
+			return readAs<std::int32_t>(p, bigEndian);
+		case PlyType::uint32:
+			return readAs<std::uint32_t>(p, bigEndian);
+		case PlyType::float32:
+			return readAs<float>(p, bigEndian);
+		default:
+			return readAs<double>(p, bigEndian);
+		}
+	}
+
+	// Reads the records of a PLY element one property at a time, from either kind of body.
+	class PlyReader
+	{
+		const std::byte* p;
+		const std::byte* end;
+		PlyFormat format;
+		const std::string& filename;
+
+		[[noreturn]] void fail() const
+		{
+			throw std::runtime_error("Element data in file '" + filename + "' is cut off or "
+				"malformed!");
+		}
+
+	public:
+		PlyReader(const std::byte* p, const std::byte* end, const PlyFormat format,
+			const std::string& filename) : p(p), end(end), format(format), filename(filename) {}
+
+		const std::byte* getPosition() const
+		{
+			return p;
+		}
+		void seek(const std::byte* position)
+		{
+			p = position;
+		}
+
+		double read(const PlyType type)
+		{
+			if (format == PlyFormat::ascii)
+			{
+				const char* text = reinterpret_cast<const char*>(p);
+				const char* textEnd = reinterpret_cast<const char*>(end);
+				while (text < textEnd && (isSpace(*text) || *text == '\n'))
+				{
+					text++;
+				}
+				double value;
+				if (!parseNumber(text, textEnd, value))
+				{
+					fail();
+				}
+				p = reinterpret_cast<const std::byte*>(text);
+				return value;
+			}
+			const std::size_t size = getSize(type);
+			if (static_cast<std::size_t>(end - p) < size)
+			{
+				fail();
+			}
+			const double value = readPlyValue(p, type, format == PlyFormat::binaryBigEndian);
+			p += size;
+			return value;
+		}
+		// The length of a list, which has to fit into what is left of the body.
+		std::size_t readCount(const PlyProperty& property)
+		{
+			const double count = read(property.countType);
+			const std::size_t itemSize = format == PlyFormat::ascii ? 2 : getSize(property.type);
+			if (!(count >= 0.0) || count != std::floor(count) ||
+				count > static_cast<double>(static_cast<std::size_t>(end - p) / itemSize))
+			{
+				fail();
+			}
+			return static_cast<std::size_t>(count);
+		}
+		// Reject element counts that can't fit into what is left of the body, before anything
+		// gets allocated for them. An ASCII value takes at least a digit and a separator, except
+		// at the very end of the body.
+		void checkCount(const PlyElement& element) const
+		{
+			std::size_t recordSize = 0;
+			for (const PlyProperty& property : element.properties)
+			{
+				recordSize += format == PlyFormat::ascii ? 2 :
+					getSize(property.isList ? property.countType : property.type);
+			}
+			const std::size_t available = static_cast<std::size_t>(end - p) +
+				(format == PlyFormat::ascii ? 1 : 0);
+			if (element.count > available / std::max<std::size_t>(recordSize, 1))
+			{
+				fail();
+			}
+		}
+		void skip(const PlyProperty& property)
+		{
+			const std::size_t count = property.isList ? readCount(property) : 1;
+			for (std::size_t i = 0; i < count; i++)
+			{
+				read(property.type);
+			}
+		}
+		// Past the end of the current line, so that an ASCII record can't spill into the next.
+		void finishRecord()
+		{
+			if (format != PlyFormat::ascii)
+			{
+				return;
+			}
+			const char* text = reinterpret_cast<const char*>(p);
+			const char* lineEnd = findLineEnd(text, reinterpret_cast<const char*>(end));
+			if (skipSpaces(text, lineEnd) != lineEnd)
+			{
+				fail();
+			}
+			p = reinterpret_cast<const std::byte*>(lineEnd < reinterpret_cast<const char*>(end) ?
+				lineEnd + 1 : lineEnd);
+		}
+	};
+}
+
+export namespace graphics
+{
+	// Indexed mesh data read from a file, with one color, normal and texture coordinate (if any)
+	// per vertex. Files without colors get white vertices, and files without normals get smooth
+	// ones.
+	struct ImportedMesh
+	{
+		std::vector<math::Vec3> vertices;
+		std::vector<math::Vec4> colors;
+		std::vector<math::Vec3> normals;
+		std::vector<math::Vec2> textureCoordinates;
+		std::vector<std::array<unsigned int, 3>> triangles;
+
+		// Give every vertex that has a zero normal the area-weighted average of the normals of
+		// its triangles.
+		void completeNormals()
+		{
+			normals.resize(vertices.size(), math::Vec3(0.0f));
+			std::vector<math::Vec3> smooth(vertices.size(), math::Vec3(0.0f));
+			for (const std::array<unsigned int, 3>& triangle : triangles)
+			{
+				const math::Vec3 normal = (vertices[triangle[1]] - vertices[triangle[0]]).cross(
+					vertices[triangle[2]] - vertices[triangle[0]]);
+				for (const unsigned int vertex : triangle)
+				{
+					smooth[vertex] += normal;
+				}
+			}
+			for (std::size_t i = 0; i < vertices.size(); i++)
+			{
+				if (normals[i].norm() == 0.0f && smooth[i].norm() > 0.0f)
+				{
+					normals[i] = smooth[i].unit();
+				}
+			}
+		}
+	};
+
+	// Wavefront OBJ: positions (optionally followed by a color), texture coordinates, normals
+	// and polygons, which are split into fans of triangles. The file is mapped into memory and
+	// parsed in parallel chunks of whole lines. Every distinct combination of position, texture
+	// coordinate and normal becomes one vertex. Everything else, like materials and groups, is
+	// ignored.
+	ImportedMesh importObj(const std::string& filename)
+	{
+		const MappedFile file(filename);
+		const char* begin = reinterpret_cast<const char*>(file.getData());
+		const char* end = begin + file.getSize();
+		const std::vector<const char*> bounds = splitLines(begin, end,
+			getChunkCount(file.getSize()));
+		std::vector<ObjChunk> chunks(bounds.size() - 1);
+		parallelChunks(chunks.size(), [&](const std::size_t i)
+			{
+				parseObjChunk(bounds[i], bounds[i + 1], chunks[i], filename);
+			}
+		);
+
+		// Now that every chunk is parsed, relative indices can be made absolute.
+		std::vector<math::Vec3> positions;
+		std::vector<math::Vec3> positionColors;
+		std::vector<math::Vec2> textureCoordinates;
+		std::vector<math::Vec3> normals;
+		std::vector<std::array<std::size_t, 3>> offsets(chunks.size());
+		bool hasColors = false;
+		for (std::size_t i = 0; i < chunks.size(); i++)
+		{
+			offsets[i] = {positions.size(), textureCoordinates.size(), normals.size()};
+			positions.insert(positions.end(), chunks[i].positions.begin(),
+				chunks[i].positions.end());
+			positionColors.insert(positionColors.end(), chunks[i].colors.begin(),
+				chunks[i].colors.end());
+			textureCoordinates.insert(textureCoordinates.end(),
+				chunks[i].textureCoordinates.begin(), chunks[i].textureCoordinates.end());
+			normals.insert(normals.end(), chunks[i].normals.begin(), chunks[i].normals.end());
+			hasColors = hasColors || chunks[i].hasColors;
+		}
+		const std::array<std::size_t, 3> sizes = {positions.size(), textureCoordinates.size(),
+			normals.size()};
+
+		ImportedMesh mesh;
+		std::unordered_map<std::array<std::int64_t, 3>, unsigned int, VertexTupleHash> vertices;
+		bool hasTextureCoordinates = false;
+		for (std::size_t i = 0; i < chunks.size(); i++)
+		{
+			for (const std::array<ObjCorner, 3>& triangle : chunks[i].triangles)
+			{
+				std::array<unsigned int, 3>& indices = mesh.triangles.emplace_back();
+				for (std::size_t j = 0; j < 3; j++)
+				{
+					std::array<std::int64_t, 3> tuple = {-1, -1, -1};
+					for (std::size_t k = 0; k < 3; k++)
+					{
+						const ObjIndex& index = triangle[j].indices[k];
+						if (index.kind == ObjIndexKind::none)
+						{
+							continue;
+						}
+						tuple[k] = index.value + (index.kind == ObjIndexKind::relative ?
+							static_cast<std::int64_t>(offsets[i][k]) : 0);
+						if (tuple[k] < 0 || tuple[k] >= static_cast<std::int64_t>(sizes[k]))
+						{
+							throw std::runtime_error("Face in file '" + filename +
+								"' refers to a vertex that doesn't exist!");
+						}
+					}
+					hasTextureCoordinates = hasTextureCoordinates || tuple[1] >= 0;
+
+					const auto [vertex, inserted] = vertices.try_emplace(tuple,
+						static_cast<unsigned int>(mesh.vertices.size()));
+					if (inserted)
+					{
+						mesh.vertices.push_back(positions[tuple[0]]);
+						const math::Vec3& color = positionColors[tuple[0]];
+						mesh.colors.push_back({color.x(), color.y(), color.z(), 1.0f});
+						mesh.normals.push_back(tuple[2] >= 0 ? normals[tuple[2]] :
+							math::Vec3(0.0f));
+						mesh.textureCoordinates.push_back(tuple[1] >= 0 ?
+							textureCoordinates[tuple[1]] : math::Vec2(0.0f));
+					}
+					indices[j] = vertex->second;
+				}
+			}
+		}
+		if (!hasTextureCoordinates)
+		{
+			mesh.textureCoordinates.clear();
+		}
+		if (!hasColors)
+		{
+			std::fill(mesh.colors.begin(), mesh.colors.end(), math::Vec4(1.0f));
+		}
+		mesh.completeNormals();
+		return mesh;
+	}
+
+	// Stanford PLY in ASCII or either binary byte order. The vertex element may have
+	// positions, normals (nx, ny, nz), colors (red, green, blue, alpha) and texture coordinates
+	// (u and v or s and t), and the face element a list of vertex indices. Other elements and
+	// properties are skipped. Vertices of binary files without list properties are parsed in
+	// parallel.
+	ImportedMesh importPly(const std::string& filename)
+	{
+		const MappedFile file(filename);
+		const char* text = reinterpret_cast<const char*>(file.getData());
+		const char* textEnd = text + file.getSize();
+		const auto fail = [&](const std::string& problem)
+		{
+			throw std::runtime_error(problem + " in file '" + filename + "'!");
+		};
+
+		PlyFormat format = PlyFormat::ascii;
+		std::vector<PlyElement> elements;
+		bool first = true;
+		for (const char* line = text;; line = findLineEnd(line, textEnd) + 1)
+		{
+			if (line >= textEnd)
+			{
+				fail("Header is cut off");
+			}
+			std::vector<std::string_view> words;
+			const char* lineEnd = findLineEnd(line, textEnd);
+			for (const char* p = skipSpaces(line, lineEnd); p < lineEnd;
+				p = skipSpaces(p, lineEnd))
+			{
+				const char* wordEnd = std::find_if(p, lineEnd, isSpace);
+				words.emplace_back(p, static_cast<std::size_t>(wordEnd - p));
+				p = wordEnd;
+			}
+			if (first)
+			{
+				if (words.size() != 1 || words[0] != "ply")
+				{
+					fail("Invalid header");
+				}
+				first = false;
+			}
+			else if (words.empty() || words[0] == "comment" || words[0] == "obj_info")
+			{
+				continue;
+			}
+			else if (words[0] == "format" && words.size() >= 2)
+			{
+				if (words[1] == "ascii")
+				{
+					format = PlyFormat::ascii;
+				}
+				else if (words[1] == "binary_little_endian")
+				{
+					format = PlyFormat::binaryLittleEndian;
+				}
+				else if (words[1] == "binary_big_endian")
+				{
+					format = PlyFormat::binaryBigEndian;
+				}
+				else
+				{
+					fail("Unknown format");
+				}
+			}
+			else if (words[0] == "element" && words.size() == 3)
+			{
+				PlyElement& element = elements.emplace_back();
+				element.name = words[1];
+				const char* countEnd = words[2].data() + words[2].size();
+				if (std::from_chars(words[2].data(), countEnd, element.count).ptr != countEnd)
+				{
+					fail("Invalid element count");
+				}
+			}
+			else if (words[0] == "property" && !elements.empty() && words.size() == 3)
+			{
+				elements.back().properties.push_back({std::string(words[2]),
+					parsePlyType(words[1], filename)});
+			}
+			else if (words[0] == "property" && !elements.empty() && words.size() == 5 &&
+				words[1] == "list")
+			{
+				elements.back().properties.push_back({std::string(words[4]),
+					parsePlyType(words[3], filename), true, parsePlyType(words[2], filename)});
+			}
+			else if (words[0] == "end_header")
+			{
+				text = lineEnd < textEnd ? lineEnd + 1 : textEnd;
+				break;
+			}
+			else
+			{
+				fail("Invalid header");
+			}
+		}
+
+		ImportedMesh mesh;
+		const std::byte* body = reinterpret_cast<const std::byte*>(text);
+		const std::byte* bodyEnd = file.getData() + file.getSize();
+		PlyReader reader(body, bodyEnd, format, filename);
+		for (const PlyElement& element : elements)
+		{
+			reader.checkCount(element);
+			if (element.name == "vertex")
+			{
+				// Which property holds each of x, y, z, nx, ny, nz, red, green, blue, alpha, u
+				// and v.
+				static constexpr std::array<std::array<std::string_view, 3>, 12> names = {{
+					{"x"}, {"y"}, {"z"}, {"nx"}, {"ny"}, {"nz"},
+					{"red", "r", "diffuse_red"}, {"green", "g", "diffuse_green"},
+					{"blue", "b", "diffuse_blue"}, {"alpha", "a"},
+					{"u", "s", "texture_u"}, {"v", "t", "texture_v"}
+				}};
+				std::array<std::size_t, 12> roles;
+				roles.fill(element.properties.size());
+				bool hasLists = false;
+				for (std::size_t i = 0; i < element.properties.size(); i++)
+				{
+					hasLists = hasLists || element.properties[i].isList;
+					for (std::size_t role = 0; role < names.size(); role++)
+					{
+						if (std::find(names[role].begin(), names[role].end(),
+							element.properties[i].name) != names[role].end())
+						{
+							roles[role] = i;
+						}
+					}
+				}
+				const auto has = [&](const std::size_t role)
+				{
+					return roles[role] < element.properties.size() &&
+						!element.properties[roles[role]].isList;
+				};
+				if (!has(0) || !has(1) || !has(2))
+				{
+					fail("Vertex positions not found");
+				}
+
+				mesh.vertices.resize(element.count);
+				mesh.colors.assign(element.count, math::Vec4(1.0f));
+				mesh.normals.assign(element.count, math::Vec3(0.0f));
+				if (has(10) && has(11))
+				{
+					mesh.textureCoordinates.resize(element.count);
+				}
+				const auto readVertex = [&](PlyReader& vertexReader, const std::size_t i)
+				{
+					std::array<double, 12> values = {0.0, 0.0, 0.0, 0.0, 0.0, 0.0,
+						1.0, 1.0, 1.0, 1.0, 0.0, 0.0};
+					for (std::size_t j = 0; j < element.properties.size(); j++)
+					{
+						const PlyProperty& property = element.properties[j];
+						const std::size_t role = static_cast<std::size_t>(
+							std::find(roles.begin(), roles.end(), j) - roles.begin());
+						if (role == roles.size() || property.isList)
+						{
+							vertexReader.skip(property);
+							continue;
+						}
+						values[role] = vertexReader.read(property.type);
+						if (role >= 6 && role < 10)
+						{
+							values[role] = toColorComponent(values[role], property.type);
+						}
+					}
+					vertexReader.finishRecord();
+					mesh.vertices[i] = {static_cast<float>(values[0]),
+						static_cast<float>(values[1]), static_cast<float>(values[2])};
+					if (has(3) && has(4) && has(5))
+					{
+						mesh.normals[i] = {static_cast<float>(values[3]),
+							static_cast<float>(values[4]), static_cast<float>(values[5])};
+					}
+					for (std::size_t k = 0; k < 4; k++)
+					{
+						mesh.colors[i][k] = static_cast<float>(values[6 + k]);
+					}
+					if (!mesh.textureCoordinates.empty())
+					{
+						mesh.textureCoordinates[i] = {static_cast<float>(values[10]),
+							static_cast<float>(values[11])};
+					}
+				};
+
+				if (format == PlyFormat::ascii || hasLists)
+				{
+					for (std::size_t i = 0; i < element.count; i++)
+					{
+						readVertex(reader, i);
+					}
+					continue;
+				}
+
+				// Every binary vertex has the same size, so chunks of them can be read at once.
+				std::size_t stride = 0;
+				for (const PlyProperty& property : element.properties)
+				{
+					stride += getSize(property.type);
+				}
+				const std::byte* vertices = reader.getPosition();
+				static constexpr std::size_t chunkSize = 1 << 16;
+				parallelChunks((element.count + chunkSize - 1) / chunkSize,
+					[&](const std::size_t chunk)
+					{
+						const std::size_t last = std::min((chunk + 1) * chunkSize,
+							element.count);
+						PlyReader chunkReader(vertices + chunk * chunkSize * stride, bodyEnd,
+							format, filename);
+						for (std::size_t i = chunk * chunkSize; i < last; i++)
+						{
+							readVertex(chunkReader, i);
+						}
+					}
+				);
+				reader.seek(vertices + element.count * stride);
+			}
+			else if (element.name == "face")
+			{
+				mesh.triangles.reserve(mesh.triangles.size() + element.count);
+				std::vector<unsigned int> polygon;
+				for (std::size_t i = 0; i < element.count; i++)
+				{
+					for (const PlyProperty& property : element.properties)
+					{
+						if (!property.isList || (property.name != "vertex_indices" &&
+							property.name != "vertex_index"))
+						{
+							reader.skip(property);
+							continue;
+						}
+						polygon.resize(reader.readCount(property));
+						for (unsigned int& vertex : polygon)
+						{
+							const double index = reader.read(property.type);
+							if (index < 0.0 || index >= static_cast<double>(mesh.vertices.size()))
+							{
+								fail("Face refers to a vertex that doesn't exist");
+							}
+							vertex = static_cast<unsigned int>(index);
+						}
+						for (std::size_t j = 1; j + 1 < polygon.size(); j++)
+						{
+							mesh.triangles.push_back({polygon[0], polygon[j], polygon[j + 1]});
+						}
+					}
+					reader.finishRecord();
+				}
+			}
+			else
+			{
+				for (std::size_t i = 0; i < element.count; i++)
+				{
+					for (const PlyProperty& property : element.properties)
+					{
+						reader.skip(property);
+					}
+					reader.finishRecord();
+				}
+			}
+		}
+		mesh.completeNormals();
+		return mesh;
+	}
+}
@@ -0,0 +1,282 @@
+export module graphics:MeshOptimization;
+
+import :TriangleMesh;
+
+import math;
+
+import <array>;
+import <vector>;
+import <unordered_map>;
+import <functional>;
+import <algorithm>;
+import <type_traits>;
+import <utility>;
+import <cstdint>;
+import <cstddef>;
+
+namespace graphics
+{
+	constexpr std::uint32_t noVertex = ~std::uint32_t(0);
+
+	// Every attribute of a vertex, with the attributes the mesh doesn't have left at zero.
+	using VertexKey = std::array<float, 12>;
+
+	struct VertexKeyHash
+	{
+		std::size_t operator()(const VertexKey& key) const
+		{
+			std::size_t hash = 0;
+			for (const float component : key)
+			{
+				hash = hash * 31 + std::hash<float>()(component);
+			}
+			return hash;
+		}
+	};
+
+	template<std::size_t N>
+	void setVertexKey(VertexKey& key, const std::size_t offset, const math::Vector<N>& attribute)
+	{
+		for (std::size_t i = 0; i < N; i++)
+		{
+			// Adding zero turns -0 into 0, which compares equal but hashes differently.
+			key[offset + i] = attribute[i] + 0.0f;
+		}
+	}
+
+	VertexKey getVertexKey(const TriangleMesh& mesh, const std::size_t i,
+		const bool includeNormal)
+	{
+		VertexKey key{};
+		setVertexKey(key, 0, mesh.vertices[i]);
+		if (!mesh.colors.empty())
+		{
+			setVertexKey(key, 3, mesh.colors[i]);
+		}
+		if (includeNormal && !mesh.normals.empty())
+		{
+			setVertexKey(key, 7, mesh.normals[i]);
+		}
+		if (!mesh.textureCoordinates.empty())
+		{
+			setVertexKey(key, 10, mesh.textureCoordinates[i]);
+		}
+		return key;
+	}
+
+	// Keep the vertices that remap assigns an index to, at that index, and drop the others.
+	void remapVertices(TriangleMesh& mesh, const std::vector<std::uint32_t>& remap,
+		const std::size_t vertexCount)
+	{
+		const auto apply = [&](auto& attribute)
+		{
+			if (attribute.empty())
+			{
+				return;
+			}
+			std::remove_reference_t<decltype(attribute)> remapped(vertexCount);
+			for (std::size_t i = 0; i < remap.size(); i++)
+			{
+				if (remap[i] != noVertex)
+				{
+					remapped[remap[i]] = attribute[i];
+				}
+			}
+			attribute = std::move(remapped);
+		};
+		apply(mesh.vertices);
+		apply(mesh.colors);
+		apply(mesh.normals);
+		apply(mesh.textureCoordinates);
+		for (std::array<unsigned int, 3>& triangle : mesh.triangles)
+		{
+			for (unsigned int& vertex : triangle)
+			{
+				vertex = remap[vertex];
+			}
+		}
+	}
+}
+
+export namespace graphics
+{
+	// Merge vertices whose attributes are all identical. With ignoreNormals, vertices that only
+	// differ in their normals are merged as well, which only makes sense if the normals get
+	// recomputed afterwards.
+	void weldVertices(TriangleMesh& mesh, const bool ignoreNormals = false)
+	{
+		mesh.decompress();
+		std::unordered_map<VertexKey, std::uint32_t, VertexKeyHash> indices;
+		std::vector<std::uint32_t> remap(mesh.vertices.size());
+		for (std::size_t i = 0; i < mesh.vertices.size(); i++)
+		{
+			remap[i] = indices.try_emplace(getVertexKey(mesh, i, !ignoreNormals),
+				static_cast<std::uint32_t>(indices.size())).first->second;
+		}
+		remapVertices(mesh, remap, indices.size());
+	}
+
+	// Replace the normals by the area-weighted average of the normals of the triangles that
+	// share each vertex. Vertices that only belong to degenerate triangles get a zero normal.
+	void computeSmoothNormals(TriangleMesh& mesh)
+	{
+		mesh.decompress();
+		mesh.normals.assign(mesh.vertices.size(), math::Vec3(0.0f));
+		for (const std::array<unsigned int, 3>& triangle : mesh.triangles)
+		{
+			const math::Vec3 normal = (mesh.vertices[triangle[1]] -
+				mesh.vertices[triangle[0]]).cross(mesh.vertices[triangle[2]] -
+				mesh.vertices[triangle[0]]);
+			for (const unsigned int vertex : triangle)
+			{
+				mesh.normals[vertex] += normal;
+			}
+		}
+		for (math::Vec3& normal : mesh.normals)
+		{
+			if (normal.norm() > 0.0f)
+			{
+				normal.normalize();
+			}
+		}
+	}
+
+	// Reorder the triangles so that vertices get reused while they are still in a
+	// post-transform cache of cacheSize vertices, using Tipsify.
+	// https://gfx.cs.princeton.edu/pubs/Sander_2007_%3ETR/tipsy.pdf
+	void optimizeVertexCache(TriangleMesh& mesh, const std::size_t cacheSize = 16)
+	{
+		mesh.decompress();
+		const std::size_t vertexCount = mesh.vertices.size();
+		if (vertexCount == 0 || mesh.triangles.empty())
+		{
+			return;
+		}
+		std::vector<std::vector<std::uint32_t>> adjacency(vertexCount);
+		for (std::size_t i = 0; i < mesh.triangles.size(); i++)
+		{
+			for (const unsigned int vertex : mesh.triangles[i])
+			{
+				adjacency[vertex].push_back(static_cast<std::uint32_t>(i));
+			}
+		}
+
+		std::vector<std::size_t> liveTriangles(vertexCount);
+		for (std::size_t i = 0; i < vertexCount; i++)
+		{
+			liveTriangles[i] = adjacency[i].size();
+		}
+		// A vertex is in the cache while time - cacheTimes[vertex] <= cacheSize.
+		std::vector<std::size_t> cacheTimes(vertexCount, 0);
+		std::size_t time = cacheSize + 1;
+		std::vector<bool> emitted(mesh.triangles.size(), false);
+		std::vector<std::uint32_t> deadEnds;
+		std::vector<std::uint32_t> candidates;
+		std::size_t cursor = 0;
+		std::vector<std::array<unsigned int, 3>> ordered;
+		ordered.reserve(mesh.triangles.size());
+
+		std::uint32_t fanning = 0;
+		while (fanning != noVertex)
+		{
+			candidates.clear();
+			for (const std::uint32_t triangle : adjacency[fanning])
+			{
+				if (emitted[triangle])
+				{
+					continue;
+				}
+				emitted[triangle] = true;
+				ordered.push_back(mesh.triangles[triangle]);
+				for (const unsigned int vertex : mesh.triangles[triangle])
+				{
+					deadEnds.push_back(vertex);
+					candidates.push_back(vertex);
+					liveTriangles[vertex]--;
+					if (time - cacheTimes[vertex] > cacheSize)
+					{
+						cacheTimes[vertex] = time;
+						time++;
+					}
+				}
+			}
+
+			// Prefer the candidate that has been in the cache the longest, as long as its
+			// remaining triangles would still find it there.
+			fanning = noVertex;
+			std::size_t bestPriority = 0;
+			for (const std::uint32_t vertex : candidates)
+			{
+				if (liveTriangles[vertex] == 0)
+				{
+					continue;
+				}
+				std::size_t priority = 1;
+				if (time - cacheTimes[vertex] + 2 * liveTriangles[vertex] <= cacheSize)
+				{
+					priority += time - cacheTimes[vertex];
+				}
+				if (priority > bestPriority)
+				{
+					bestPriority = priority;
+					fanning = vertex;
+				}
+			}
+
+			// Otherwise go back to a recently used vertex, or the next one in the input order.
+			while (fanning == noVertex && !deadEnds.empty())
+			{
+				if (liveTriangles[deadEnds.back()] > 0)
+				{
+					fanning = deadEnds.back();
+				}
+				deadEnds.pop_back();
+			}
+			for (; fanning == noVertex && cursor < vertexCount; cursor++)
+			{
+				if (liveTriangles[cursor] > 0)
+				{
+					fanning = static_cast<std::uint32_t>(cursor);
+				}
+			}
+		}
+		mesh.triangles = std::move(ordered);
+	}
+
+	// Renumber the vertices in the order the triangles first use them, so that vertex fetches
+	// walk through memory roughly sequentially. Unused vertices are dropped.
+	void optimizeVertexFetch(TriangleMesh& mesh)
+	{
+		mesh.decompress();
+		std::vector<std::uint32_t> remap(mesh.vertices.size(), noVertex);
+		std::uint32_t vertexCount = 0;
+		for (const std::array<unsigned int, 3>& triangle : mesh.triangles)
+		{
+			for (const unsigned int vertex : triangle)
+			{
+				if (remap[vertex] == noVertex)
+				{
+					remap[vertex] = vertexCount++;
+				}
+			}
+		}
+		remapVertices(mesh, remap, vertexCount);
+	}
+
+	// Weld the vertices, optionally replace the normals by smooth ones, and reorder the
+	// triangles and vertices for the vertex cache and memory locality. Meshlets and levels of
+	// detail depend on the order of the triangles, so they have to be built afterwards.
+	void optimizeMesh(TriangleMesh& mesh, const bool smoothNormals = false)
+	{
+		weldVertices(mesh, smoothNormals);
+		if (smoothNormals)
+		{
+			computeSmoothNormals(mesh);
+		}
+		optimizeVertexCache(mesh);
+		optimizeVertexFetch(mesh);
+		mesh.meshlets.clear();
+		mesh.lods.clear();
+		mesh.updateBounds();
+	}
+}
@@ -4,6 +4,7 @@ import :forward;
 import :Vector;
 import :Matrix;
 
+import <array>;
 import <vector>;
 import <cmath>;
 
@@ -24,11 +25,8 @@ export namespace math
 		Mat3 projectionMatrix;
 		unsigned int width;
 		unsigned int height;
-
-		// Shadow map rasterization parameters.
-		Mat3 sc;
-		Vec3 sp;
-		Vec3 p;
+		// Distance along the view direction below which geometry gets clipped.
+		float nearDistance = 1.0f;
 
 		constexpr PinholeCamera() = default;
 		explicit constexpr PinholeCamera(const unsigned int width, const unsigned int height,
@@ -64,6 +62,33 @@ export namespace math
 			return {-c.dot(a), -c.dot(b)};
 		}
 
+		// Planes (n, d) of the view frustum in world space, with the normals n pointing inwards and
+		// of unit length. A point p is inside of the frustum if n.dot(p) + d >= 0 for every plane.
+		// The near plane comes first, followed by the planes through the edges of the image.
+		// There is no far plane.
+		std::array<Vec4, 5> getFrustumPlanes() const
+		{
+			const Vec3 viewDirection = getViewDirection();
+			const float w = static_cast<float>(width);
+			const float h = static_cast<float>(height);
+			const std::array<Vec3, 4> corners = {c, c + a * w, c + a * w + b * h, c + b * h};
+			const Vec3 middle = c + a * (w / 2.0f) + b * (h / 2.0f);
+
+			std::array<Vec4, 5> planes;
+			planes[0] = Vec4(viewDirection.x(), viewDirection.y(), viewDirection.z(),
+				-viewDirection.dot(center) - nearDistance);
+			for (std::size_t i = 0; i < 4; i++)
+			{
+				Vec3 normal = corners[i].cross(corners[(i + 1) % 4]).unit();
+				if (normal.dot(middle) < 0.0f)
+				{
+					normal = -normal;
+				}
+				planes[i + 1] = Vec4(normal.x(), normal.y(), normal.z(), -normal.dot(center));
+			}
+			return planes;
+		}
+
 		constexpr void translateHorizontally(const float distance)
 		{
 			center += a * distance;
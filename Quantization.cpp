@@ -0,0 +1,103 @@
+export module graphics:Quantization;
+
+import math;
+
+import <array>;
+import <algorithm>;
+import <bit>;
+import <cmath>;
+import <cstdint>;
+import <cstddef>;
+
+export namespace graphics
+{
+	// https://jcgt.org/published/0003/02/01/
+	std::array<std::int16_t, 2> encodeOctahedral(const math::Vec3& normal)
+	{
+		const float length = std::abs(normal.x()) + std::abs(normal.y()) + std::abs(normal.z());
+		float x = length > 0.0f ? normal.x() / length : 0.0f;
+		float y = length > 0.0f ? normal.y() / length : 0.0f;
+		if (normal.z() < 0.0f)
+		{
+			const float foldedX = (1.0f - std::abs(y)) * std::copysign(1.0f, x);
+			y = (1.0f - std::abs(x)) * std::copysign(1.0f, y);
+			x = foldedX;
+		}
+		return {
+			static_cast<std::int16_t>(std::round(std::clamp(x, -1.0f, 1.0f) * 32767.0f)),
+			static_cast<std::int16_t>(std::round(std::clamp(y, -1.0f, 1.0f) * 32767.0f))
+		};
+	}
+	math::Vec3 decodeOctahedral(const std::array<std::int16_t, 2>& encoded)
+	{
+		float x = std::max(encoded[0] / 32767.0f, -1.0f);
+		float y = std::max(encoded[1] / 32767.0f, -1.0f);
+		const float z = 1.0f - std::abs(x) - std::abs(y);
+		if (z < 0.0f)
+		{
+			const float unfoldedX = (1.0f - std::abs(y)) * std::copysign(1.0f, x);
+			y = (1.0f - std::abs(x)) * std::copysign(1.0f, y);
+			x = unfoldedX;
+		}
+		return math::Vec3(x, y, z).unit();
+	}
+
+	// Round to the nearest half float, with ties to even. Values too large for a half float
+	// become infinity. https://gist.github.com/rygorous/2156668
+	std::uint16_t toHalf(const float value)
+	{
+		std::uint32_t bits = std::bit_cast<std::uint32_t>(value);
+		const std::uint32_t sign = bits & 0x80000000u;
+		bits ^= sign;
+		std::uint32_t half;
+		if (bits >= 0x47800000u)
+		{
+			half = bits > 0x7f800000u ? 0x7e00u : 0x7c00u;
+		}
+		else if (bits < 0x38800000u)
+		{
+			// Subnormal: adding 0.5 lines the mantissa up with the one of the half float.
+			half = std::bit_cast<std::uint32_t>(std::bit_cast<float>(bits) + 0.5f) - 0x3f000000u;
+		}
+		else
+		{
+			const std::uint32_t odd = (bits >> 13) & 1u;
+			half = (bits - 0x38000000u + 0xfffu + odd) >> 13;
+		}
+		return static_cast<std::uint16_t>(half | (sign >> 16));
+	}
+	float fromHalf(const std::uint16_t half)
+	{
+		static constexpr std::uint32_t exponentMask = 0x7c00u << 13;
+		std::uint32_t bits = (half & 0x7fffu) << 13;
+		const std::uint32_t exponent = bits & exponentMask;
+		bits += 0x38000000u;
+		if (exponent == exponentMask)
+		{
+			bits += 0x38000000u;
+		}
+		else if (exponent == 0)
+		{
+			bits += 0x00800000u;
+			bits = std::bit_cast<std::uint32_t>(std::bit_cast<float>(bits) -
+				std::bit_cast<float>(0x38800000u));
+		}
+		return std::bit_cast<float>(bits | ((half & 0x8000u) << 16));
+	}
+
+	std::array<std::uint8_t, 4> toUnorm8(const math::Vec4& color)
+	{
+		std::array<std::uint8_t, 4> packed;
+		for (std::size_t i = 0; i < 4; i++)
+		{
+			packed[i] = static_cast<std::uint8_t>(std::round(std::clamp(color[i], 0.0f, 1.0f) *
+				255.0f));
+		}
+		return packed;
+	}
+	math::Vec4 fromUnorm8(const std::array<std::uint8_t, 4>& packed)
+	{
+		return math::Vec4(packed[0] / 255.0f, packed[1] / 255.0f, packed[2] / 255.0f,
+			packed[3] / 255.0f);
+	}
+}
@@ -0,0 +1,400 @@
+export module graphics:Simplification;
+
+import :TriangleMesh;
+
+import math;
+
+import <array>;
+import <vector>;
+import <queue>;
+import <unordered_map>;
+import <functional>;
+import <initializer_list>;
+import <algorithm>;
+import <cmath>;
+import <cstdint>;
+import <cstddef>;
+
+namespace graphics
+{
+	// Quadric error metric of Garland and Heckbert: the sum of the squared distances of a point
+	// to a set of planes, stored as the upper triangle of a symmetric 4x4 matrix.
+	// https://www.cs.cmu.edu/~./garland/Papers/quadrics.pdf
+	struct Quadric
+	{
+		std::array<double, 10> q{};
+
+		static Quadric fromPlane(const math::Vec3& normal, const math::Vec3& point,
+			const double weight)
+		{
+			const double a = normal.x();
+			const double b = normal.y();
+			const double c = normal.z();
+			const double d = -normal.dot(point);
+			Quadric quadric;
+			quadric.q = {a * a, a * b, a * c, a * d, b * b, b * c, b * d, c * c, c * d, d * d};
+			for (double& entry : quadric.q)
+			{
+				entry *= weight;
+			}
+			return quadric;
+		}
+
+		Quadric& operator+=(const Quadric& rhs)
+		{
+			for (std::size_t i = 0; i < q.size(); i++)
+			{
+				q[i] += rhs.q[i];
+			}
+			return *this;
+		}
+		Quadric operator+(const Quadric& rhs) const
+		{
+			Quadric sum = *this;
+			return sum += rhs;
+		}
+
+		double evaluate(const math::Vec3& point) const
+		{
+			const double x = point.x();
+			const double y = point.y();
+			const double z = point.z();
+			return q[0] * x * x + 2.0 * q[1] * x * y + 2.0 * q[2] * x * z + 2.0 * q[3] * x +
+				q[4] * y * y + 2.0 * q[5] * y * z + 2.0 * q[6] * y + q[7] * z * z +
+				2.0 * q[8] * z + q[9];
+		}
+
+		// The point with the smallest error, if the quadric isn't close to singular.
+		bool minimize(math::Vec3& point) const
+		{
+			const double c00 = q[4] * q[7] - q[5] * q[5];
+			const double c01 = q[2] * q[5] - q[1] * q[7];
+			const double c02 = q[1] * q[5] - q[2] * q[4];
+			const double determinant = q[0] * c00 + q[1] * c01 + q[2] * c02;
+			if (std::abs(determinant) < 1e-12)
+			{
+				return false;
+			}
+			const double c11 = q[0] * q[7] - q[2] * q[2];
+			const double c12 = q[1] * q[2] - q[0] * q[5];
+			const double c22 = q[0] * q[4] - q[1] * q[1];
+			point = {
+				static_cast<float>(-(c00 * q[3] + c01 * q[6] + c02 * q[8]) / determinant),
+				static_cast<float>(-(c01 * q[3] + c11 * q[6] + c12 * q[8]) / determinant),
+				static_cast<float>(-(c02 * q[3] + c12 * q[6] + c22 * q[8]) / determinant)
+			};
+			return true;
+		}
+	};
+
+	struct Collapse
+	{
+		double cost;
+		std::uint32_t from;
+		std::uint32_t to;
+		std::uint32_t fromVersion;
+		std::uint32_t toVersion;
+		math::Vec3 position;
+
+		bool operator>(const Collapse& rhs) const
+		{
+			return cost > rhs.cost;
+		}
+	};
+
+	// Edges that only belong to a single triangle are held in place by planes perpendicular to
+	// their triangle, weighted this much more than the surface itself.
+	constexpr double boundaryWeight = 1000.0;
+}
+
+export namespace graphics
+{
+	// Collapse edges of the mesh in order of increasing quadric error until at most
+	// triangleCount triangles are left, or until no collapse is possible without flipping a
+	// triangle. The attributes of a collapsed edge are interpolated at the new position.
+	TriangleMesh simplify(const TriangleMesh& mesh, const std::size_t triangleCount)
+	{
+		if (mesh.isCompressed())
+		{
+			TriangleMesh decompressed = mesh;
+			decompressed.decompress();
+			return simplify(decompressed, triangleCount);
+		}
+
+		std::vector<math::Vec3> positions = mesh.vertices;
+		std::vector<math::Vec4> colors = mesh.colors;
+		std::vector<math::Vec3> normals = mesh.normals;
+		std::vector<math::Vec2> textureCoordinates = mesh.textureCoordinates;
+		std::vector<std::array<std::uint32_t, 3>> triangles(mesh.triangles.size());
+		for (std::size_t i = 0; i < triangles.size(); i++)
+		{
+			for (std::size_t k = 0; k < 3; k++)
+			{
+				triangles[i][k] = mesh.triangles[i][k];
+			}
+		}
+
+		const auto getNormal = [&](const std::array<std::uint32_t, 3>& triangle)
+		{
+			return (positions[triangle[1]] - positions[triangle[0]]).cross(
+				positions[triangle[2]] - positions[triangle[0]]);
+		};
+
+		std::vector<Quadric> quadrics(positions.size());
+		std::vector<std::vector<std::uint32_t>> adjacency(positions.size());
+		std::unordered_map<std::uint64_t, std::uint32_t> edgeCounts;
+		const auto getEdgeKey = [](const std::uint32_t u, const std::uint32_t v)
+		{
+			return static_cast<std::uint64_t>(std::min(u, v)) << 32 | std::max(u, v);
+		};
+		for (std::size_t i = 0; i < triangles.size(); i++)
+		{
+			const math::Vec3 normal = getNormal(triangles[i]);
+			const float area = normal.norm() / 2.0f;
+			for (std::size_t k = 0; k < 3; k++)
+			{
+				adjacency[triangles[i][k]].push_back(static_cast<std::uint32_t>(i));
+				edgeCounts[getEdgeKey(triangles[i][k], triangles[i][(k + 1) % 3])]++;
+				if (area > 0.0f)
+				{
+					quadrics[triangles[i][k]] += Quadric::fromPlane(normal.unit(),
+						positions[triangles[i][0]], area);
+				}
+			}
+		}
+		for (const std::array<std::uint32_t, 3>& triangle : triangles)
+		{
+			const math::Vec3 normal = getNormal(triangle);
+			if (normal.norm() == 0.0f)
+			{
+				continue;
+			}
+			for (std::size_t k = 0; k < 3; k++)
+			{
+				const std::uint32_t u = triangle[k];
+				const std::uint32_t v = triangle[(k + 1) % 3];
+				if (edgeCounts[getEdgeKey(u, v)] == 1)
+				{
+					const math::Vec3 edge = positions[v] - positions[u];
+					const Quadric boundary = Quadric::fromPlane(edge.cross(normal).unit(),
+						positions[u], boundaryWeight * edge.dot(edge));
+					quadrics[u] += boundary;
+					quadrics[v] += boundary;
+				}
+			}
+		}
+
+		// A queued collapse is outdated once either of its vertices has changed.
+		std::vector<std::uint32_t> versions(positions.size(), 0);
+		std::vector<bool> removed(positions.size(), false);
+		std::vector<bool> degenerate(triangles.size(), false);
+		std::priority_queue<Collapse, std::vector<Collapse>, std::greater<Collapse>> collapses;
+		const auto addCollapse = [&](const std::uint32_t from, const std::uint32_t to)
+		{
+			const Quadric quadric = quadrics[from] + quadrics[to];
+			math::Vec3 position;
+			if (!quadric.minimize(position))
+			{
+				position = (positions[from] + positions[to]) / 2.0f;
+			}
+			// Don't let a nearly singular quadric place the vertex far away from the edge.
+			for (const math::Vec3& candidate : {positions[from], positions[to]})
+			{
+				if (quadric.evaluate(candidate) < quadric.evaluate(position))
+				{
+					position = candidate;
+				}
+			}
+			collapses.push({quadric.evaluate(position), from, to, versions[from], versions[to],
+				position});
+		};
+		for (const auto& [key, count] : edgeCounts)
+		{
+			addCollapse(static_cast<std::uint32_t>(key >> 32), static_cast<std::uint32_t>(key));
+		}
+
+		std::size_t remaining = triangles.size();
+		while (remaining > triangleCount && !collapses.empty())
+		{
+			const Collapse collapse = collapses.top();
+			collapses.pop();
+			const std::uint32_t from = collapse.from;
+			const std::uint32_t to = collapse.to;
+			if (removed[from] || removed[to] || versions[from] != collapse.fromVersion ||
+				versions[to] != collapse.toVersion)
+			{
+				continue;
+			}
+
+			// Triangles that keep their area must not flip over.
+			bool flips = false;
+			for (const std::uint32_t vertex : {from, to})
+			{
+				for (const std::uint32_t i : adjacency[vertex])
+				{
+					const std::array<std::uint32_t, 3>& triangle = triangles[i];
+					if (degenerate[i] || std::count(triangle.begin(), triangle.end(), from) +
+						std::count(triangle.begin(), triangle.end(), to) == 2)
+					{
+						continue;
+					}
+					const math::Vec3 before = getNormal(triangle);
+					const math::Vec3 old = positions[vertex];
+					positions[vertex] = collapse.position;
+					const math::Vec3 after = getNormal(triangle);
+					positions[vertex] = old;
+					flips = flips || after.dot(before) <= 0.0f;
+				}
+			}
+			if (flips)
+			{
+				continue;
+			}
+
+			const math::Vec3 edge = positions[from] - positions[to];
+			const float t = edge.dot(edge) > 0.0f ? std::clamp((collapse.position -
+				positions[to]).dot(edge) / edge.dot(edge), 0.0f, 1.0f) : 0.0f;
+			positions[to] = collapse.position;
+			if (colors.size() == positions.size())
+			{
+				colors[to] = colors[to] + t * (colors[from] - colors[to]);
+			}
+			if (normals.size() == positions.size())
+			{
+				const math::Vec3 normal = normals[to] + t * (normals[from] - normals[to]);
+				normals[to] = normal.norm() > 0.0f ? normal.unit() : normals[to];
+			}
+			if (textureCoordinates.size() == positions.size())
+			{
+				textureCoordinates[to] = textureCoordinates[to] +
+					t * (textureCoordinates[from] - textureCoordinates[to]);
+			}
+			// Every edge of the remaining vertex gets a new cost, so its queued collapses become
+			// outdated.
+			quadrics[to] += quadrics[from];
+			removed[from] = true;
+			versions[to]++;
+
+			for (const std::uint32_t i : adjacency[from])
+			{
+				if (degenerate[i])
+				{
+					continue;
+				}
+				std::array<std::uint32_t, 3>& triangle = triangles[i];
+				if (std::find(triangle.begin(), triangle.end(), to) != triangle.end())
+				{
+					degenerate[i] = true;
+					remaining--;
+					continue;
+				}
+				std::replace(triangle.begin(), triangle.end(), from, to);
+				adjacency[to].push_back(i);
+			}
+			adjacency[from].clear();
+			std::erase_if(adjacency[to], [&degenerate](const std::uint32_t i)
+				{
+					return degenerate[i];
+				}
+			);
+
+			std::vector<std::uint32_t> neighbours;
+			for (const std::uint32_t i : adjacency[to])
+			{
+				for (const std::uint32_t vertex : triangles[i])
+				{
+					if (vertex != to)
+					{
+						neighbours.push_back(vertex);
+					}
+				}
+			}
+			std::sort(neighbours.begin(), neighbours.end());
+			neighbours.erase(std::unique(neighbours.begin(), neighbours.end()), neighbours.end());
+			for (const std::uint32_t neighbour : neighbours)
+			{
+				addCollapse(to, neighbour);
+			}
+		}
+
+		// Only keep the vertices that are still used, in their original order.
+		TriangleMesh simplified(mesh.material);
+		simplified.texture = mesh.texture;
+		std::vector<unsigned int> remap(positions.size(), 0);
+		std::vector<bool> used(positions.size(), false);
+		for (std::size_t i = 0; i < triangles.size(); i++)
+		{
+			if (!degenerate[i])
+			{
+				for (const std::uint32_t vertex : triangles[i])
+				{
+					used[vertex] = true;
+				}
+			}
+		}
+		for (std::size_t i = 0; i < positions.size(); i++)
+		{
+			if (!used[i])
+			{
+				continue;
+			}
+			remap[i] = static_cast<unsigned int>(simplified.vertices.size());
+			simplified.vertices.push_back(positions[i]);
+			if (colors.size() == positions.size())
+			{
+				simplified.colors.push_back(colors[i]);
+			}
+			if (normals.size() == positions.size())
+			{
+				simplified.normals.push_back(normals[i]);
+			}
+			if (textureCoordinates.size() == positions.size())
+			{
+				simplified.textureCoordinates.push_back(textureCoordinates[i]);
+			}
+		}
+		for (std::size_t i = 0; i < triangles.size(); i++)
+		{
+			if (!degenerate[i])
+			{
+				simplified.triangles.push_back({remap[triangles[i][0]], remap[triangles[i][1]],
+					remap[triangles[i][2]]});
+			}
+		}
+		simplified.updateBounds();
+		return simplified;
+	}
+
+	// Fill mesh.lods with up to levelCount coarser versions of the mesh, each with about half
+	// the triangles of the one before. Meshlets are built for every level if the mesh has them,
+	// and every level is compressed if the mesh is.
+	void buildLods(TriangleMesh& mesh, const std::size_t levelCount = 3,
+		const std::size_t minTriangleCount = 64)
+	{
+		mesh.lods.clear();
+		const TriangleMesh* previous = &mesh;
+		for (std::size_t level = 0; level < levelCount; level++)
+		{
+			const std::size_t triangleCount = previous->getTriangleCount() / 2;
+			if (triangleCount < minTriangleCount)
+			{
+				break;
+			}
+			TriangleMesh lod = simplify(*previous, triangleCount);
+			if (lod.getTriangleCount() >= previous->getTriangleCount())
+			{
+				break;
+			}
+			if (!mesh.meshlets.empty())
+			{
+				lod.buildMeshlets();
+			}
+			if (mesh.isCompressed())
+			{
+				lod.compress();
+			}
+			mesh.lods.push_back(std::move(lod));
+			previous = &mesh.lods.back();
+		}
+	}
+}
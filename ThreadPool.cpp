@@ -0,0 +1,148 @@
+export module graphics:ThreadPool;
+
+import <vector>;
+import <deque>;
+import <memory>;
+import <thread>;
+import <mutex>;
+import <condition_variable>;
+import <atomic>;
+import <functional>;
+import <algorithm>;
+import <cstddef>;
+
+export namespace graphics
+{
+	// A fixed set of worker threads used to split up loops. The thread calling parallelFor()
+	// always works on its own loop as well, so parallelFor() may be called from inside another
+	// parallelFor() without deadlocking.
+	class ThreadPool
+	{
+		struct Batch
+		{
+			const std::function<void(std::size_t)>& task;
+			const std::size_t count;
+			std::atomic<std::size_t> next;
+			std::atomic<std::size_t> done;
+
+			Batch(const std::function<void(std::size_t)>& task, const std::size_t count) :
+				task(task), count(count), next(0), done(0) {}
+		};
+
+		std::vector<std::thread> workers;
+		std::deque<std::shared_ptr<Batch>> batches;
+		std::mutex mutex;
+		std::condition_variable batchAvailable;
+		std::condition_variable batchDone;
+		bool stopping;
+
+		void work(Batch& batch)
+		{
+			std::size_t i;
+			while ((i = batch.next++) < batch.count)
+			{
+				batch.task(i);
+				if (++batch.done == batch.count)
+				{
+					std::lock_guard<std::mutex> lock(mutex);
+					batchDone.notify_all();
+				}
+			}
+		}
+
+		void loop()
+		{
+			while (true)
+			{
+				std::shared_ptr<Batch> batch;
+				{
+					std::unique_lock<std::mutex> lock(mutex);
+					batchAvailable.wait(lock, [this]()
+						{
+							return stopping || !batches.empty();
+						}
+					);
+					if (stopping)
+					{
+						return;
+					}
+					batch = batches.front();
+					if (batch->next >= batch->count)
+					{
+						// Every iteration has been claimed already, though not necessarily
+						// finished. The thread that called parallelFor() waits for those.
+						batches.pop_front();
+						continue;
+					}
+				}
+				work(*batch);
+			}
+		}
+
+	public:
+		explicit ThreadPool(const std::size_t threadCount =
+			std::max(std::thread::hardware_concurrency(), 1u)) : stopping(false)
+		{
+			for (std::size_t i = 1; i < threadCount; i++)
+			{
+				workers.emplace_back(&ThreadPool::loop, this);
+			}
+		}
+		ThreadPool(const ThreadPool&) = delete;
+		ThreadPool& operator=(const ThreadPool&) = delete;
+		~ThreadPool()
+		{
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				stopping = true;
+			}
+			batchAvailable.notify_all();
+			for (std::thread& worker : workers)
+			{
+				worker.join();
+			}
+		}
+
+		std::size_t getThreadCount() const
+		{
+			return workers.size() + 1;
+		}
+
+		// Call task(i) for every i in [0, count) and return once all calls have finished. The
+		// order of the calls is unspecified.
+		void parallelFor(const std::size_t count, const std::function<void(std::size_t)>& task)
+		{
+			if (workers.empty() || count <= 1)
+			{
+				for (std::size_t i = 0; i < count; i++)
+				{
+					task(i);
+				}
+				return;
+			}
+
+			const std::shared_ptr<Batch> batch = std::make_shared<Batch>(task, count);
+			{
+				std::lock_guard<std::mutex> lock(mutex);
+				batches.push_back(batch);
+			}
+			batchAvailable.notify_all();
+
+			work(*batch);
+
+			std::unique_lock<std::mutex> lock(mutex);
+			batchDone.wait(lock, [&batch]()
+				{
+					return batch->done == batch->count;
+				}
+			);
+			batches.erase(std::remove(batches.begin(), batches.end(), batch), batches.end());
+		}
+	};
+
+	ThreadPool& getThreadPool()
+	{
+		static ThreadPool threadPool;
+		return threadPool;
+	}
+}
@@ -2,19 +2,223 @@ export module graphics:TriangleMesh;
 
 import :Framebuffer;
 import :Material;
+import :ThreadPool;
+import :BinFile;
+import :MeshFile;
+import :MeshImport;
+import :Quantization;
 
 import math;
 
 import <array>;
 import <vector>;
+import <algorithm>;
+import <cstdint>;
+import <cstddef>;
 import <numbers>;
-import <fstream>;
-import <stdexcept>;
+import <limits>;
+import <cmath>;
+import <utility>;
+import <memory>;
 
 export namespace graphics
 {
-	struct DirectionalLight;
-	class PointLight;
+	// Forward shading lights every fragment that passes the depth test. Visibility shading first
+	// records which triangle ends up in front of each pixel and then lights every pixel once.
+	// Translucent triangles are always shaded forward, after the opaque ones.
+	enum class ShadingMode
+	{
+		forward,
+		visibility
+	};
+
+	// Axis-aligned bounding box, along with a bounding sphere which may be tighter. Empty bounds
+	// have a negative radius.
+	struct Bounds
+	{
+		math::Vec3 minimum = math::Vec3(std::numeric_limits<float>::infinity());
+		math::Vec3 maximum = math::Vec3(-std::numeric_limits<float>::infinity());
+		math::Vec3 center = math::Vec3(0.0f);
+		float radius = -1.0f;
+
+		bool isEmpty() const
+		{
+			return radius < 0.0f;
+		}
+
+		void add(const math::Vec3& point)
+		{
+			for (std::size_t i = 0; i < 3; i++)
+			{
+				minimum[i] = std::min(minimum[i], point[i]);
+				maximum[i] = std::max(maximum[i], point[i]);
+			}
+			if (isEmpty())
+			{
+				center = point;
+				radius = 0.0f;
+				return;
+			}
+
+			// Grow the sphere just enough to touch the point.
+			const float distance = (point - center).norm();
+			if (distance > radius)
+			{
+				const float grownRadius = (radius + distance) / 2.0f;
+				center += (point - center) * ((grownRadius - radius) / distance);
+				radius = grownRadius;
+			}
+		}
+
+		// Grow the box and the sphere by distance in every direction.
+		void grow(const float distance)
+		{
+			if (isEmpty())
+			{
+				return;
+			}
+			minimum -= math::Vec3(distance);
+			maximum += math::Vec3(distance);
+			radius += distance;
+		}
+
+		void translate(const math::Vec3& direction)
+		{
+			minimum += direction;
+			maximum += direction;
+			center += direction;
+		}
+		void scale(const math::Vec3& origin, const float multiplier)
+		{
+			if (isEmpty())
+			{
+				return;
+			}
+			const math::Vec3 scaledMinimum = (minimum - origin) * multiplier + origin;
+			const math::Vec3 scaledMaximum = (maximum - origin) * multiplier + origin;
+			for (std::size_t i = 0; i < 3; i++)
+			{
+				minimum[i] = std::min(scaledMinimum[i], scaledMaximum[i]);
+				maximum[i] = std::max(scaledMinimum[i], scaledMaximum[i]);
+			}
+			center = (center - origin) * multiplier + origin;
+			radius *= std::abs(multiplier);
+		}
+
+		// Whether any part of the bounds may be inside of every plane, using the same planes as
+		// PinholeCamera::getFrustumPlanes().
+		template<std::size_t N>
+		bool intersects(const std::array<math::Vec4, N>& planes) const
+		{
+			if (isEmpty())
+			{
+				return false;
+			}
+			for (const math::Vec4& plane : planes)
+			{
+				const math::Vec3 normal = plane.subvector<3>();
+				if (normal.dot(center) + plane.w() < -radius)
+				{
+					return false;
+				}
+
+				// The corner of the box that is furthest along the normal.
+				const math::Vec3 corner = {
+					normal.x() >= 0.0f ? maximum.x() : minimum.x(),
+					normal.y() >= 0.0f ? maximum.y() : minimum.y(),
+					normal.z() >= 0.0f ? maximum.z() : minimum.z()
+				};
+				if (normal.dot(corner) + plane.w() < 0.0f)
+				{
+					return false;
+				}
+			}
+			return true;
+		}
+	};
+
+	// A cluster of neighbouring triangles that gets culled as a whole, both against the view
+	// frustum and by the direction its triangles are facing.
+	struct Meshlet
+	{
+		std::size_t firstTriangle = 0;
+		std::size_t triangleCount = 0;
+		Bounds bounds;
+		// The normal of every triangle is within the cone around coneAxis. coneCutoff is the sine
+		// of the angle between the axis and the normal furthest away from it, or greater than 1
+		// if the cone is too wide to ever face away from the camera.
+		math::Vec3 coneAxis = math::Vec3(0.0f);
+		float coneCutoff = 2.0f;
+
+		// Whether every triangle is back-facing for any point inside of the bounding sphere.
+		bool isBackFacing(const math::Vec3& cameraPosition) const
+		{
+			const math::Vec3 view = bounds.center - cameraPosition;
+			return view.dot(coneAxis) - bounds.radius >=
+				coneCutoff * (view.norm() + bounds.radius);
+		}
+	};
+
+	// Places the vertices of a mesh in the world: a rotation, then a uniform scale, then a
+	// translation. Because the scale is uniform, normals only need to be rotated, and bounding
+	// spheres and meshlet cones stay valid in object space.
+	struct Transform
+	{
+		math::Mat3 rotation = math::I3;
+		float scale = 1.0f;
+		math::Vec3 translation = math::Vec3(0.0f);
+
+		math::Vec3 toWorldSpace(const math::Vec3& point) const
+		{
+			return scale * (rotation * point) + translation;
+		}
+		math::Vec3 toObjectSpace(const math::Vec3& point) const
+		{
+			return rotation.transpose() * (point - translation) / scale;
+		}
+		// A plane given as in PinholeCamera::getFrustumPlanes(). The normal stays unit length.
+		math::Vec4 toObjectSpace(const math::Vec4& plane) const
+		{
+			const math::Vec3 normal = plane.subvector<3>();
+			const math::Vec3 rotated = rotation.transpose() * normal;
+			return {rotated.x(), rotated.y(), rotated.z(),
+				(normal.dot(translation) + plane.w()) / scale};
+		}
+		template<std::size_t N>
+		std::array<math::Vec4, N> toObjectSpace(const std::array<math::Vec4, N>& planes) const
+		{
+			std::array<math::Vec4, N> transformed;
+			for (std::size_t i = 0; i < N; i++)
+			{
+				transformed[i] = toObjectSpace(planes[i]);
+			}
+			return transformed;
+		}
+	};
+
+	// Everything that drawing a mesh needs besides its geometry. A mesh draws itself with the
+	// identity transform and its own material and texture, a MeshInstance with its own.
+	struct DrawParameters
+	{
+		Transform transform;
+		const Material& material;
+		const Framebuffer* texture;
+	};
+
+	// The compact form that TriangleMesh::compress() switches the attributes of a mesh to.
+	// Positions are 16-bit steps from the corner of the bounding box, colors are RGBA8,
+	// normals are octahedral-encoded into two int16s and texture coordinates are half floats.
+	// Indices take 16 bits as well if there are few enough vertices.
+	struct CompressedAttributes
+	{
+		math::Vec3 origin = math::Vec3(0.0f);
+		math::Vec3 step = math::Vec3(0.0f);
+		std::vector<std::array<std::uint16_t, 3>> positions;
+		std::vector<std::array<std::uint8_t, 4>> colors;
+		std::vector<std::array<std::int16_t, 2>> normals;
+		std::vector<std::array<std::uint16_t, 2>> textureCoordinates;
+		std::vector<std::array<std::uint16_t, 3>> triangles;
+	};
 
 	struct TriangleMesh
 	{
@@ -25,27 +229,40 @@ export namespace graphics
 		std::vector<math::Vec2> textureCoordinates;
 		Framebuffer* texture;
 		Material material;
+		// Kept up to date by the member functions, along with the meshlets. Call updateBounds()
+		// after changing vertices directly.
+		Bounds bounds;
+		// Empty unless buildMeshlets() has been called. Adding geometry clears them again.
+		std::vector<Meshlet> meshlets;
+		// Coarser versions of the mesh, see buildLods(). Adding geometry clears them as well.
+		std::vector<TriangleMesh> lods;
+		// Only used after compress(), in which case the vectors above are empty, except for
+		// triangles if the indices don't fit in 16 bits. Rendering reads the attributes through
+		// getVertex() and friends, which decode them on the fly.
+		CompressedAttributes compressed;
 
 		TriangleMesh(const Material& material = defaultMaterial) :
 			texture(nullptr), material(material) {};
 		explicit TriangleMesh(const std::string& filename,
 			const Material& material = defaultMaterial) : texture(nullptr), material(material)
 		{
-			addBin(filename);
+			addFile(filename);
 		}
 		explicit TriangleMesh(const std::string& filename, Framebuffer* texture,
 			const Material& material = defaultMaterial) : texture(texture), material(material)
 		{
-			addBin(filename);
+			addFile(filename);
 		}
 
 		void addTriangle(const math::Vec3& p1, const math::Vec3& p2, const math::Vec3& p3,
 			const math::Vec2& r1, const math::Vec2& r2, const math::Vec2& r3)
 		{
+			decompress();
 			const unsigned int i = static_cast<unsigned int>(vertices.size());
 			vertices.push_back(p1);
 			vertices.push_back(p2);
 			vertices.push_back(p3);
+			extendBounds(i);
 			triangles.push_back({i, i + 1, i + 2});
 			normals.insert(normals.end(), 3, (p2 - p1).cross(p3 - p1).unit());
 			textureCoordinates.push_back(r1);
@@ -55,10 +272,12 @@ export namespace graphics
 		void addTriangle(const math::Vec3& p1, const math::Vec3& p2, const math::Vec3& p3,
 			const math::Vec4& c1, const math::Vec4& c2, const math::Vec4& c3)
 		{
+			decompress();
 			const unsigned int i = static_cast<unsigned int>(vertices.size());
 			vertices.push_back(p1);
 			vertices.push_back(p2);
 			vertices.push_back(p3);
+			extendBounds(i);
 			triangles.push_back({i, i + 1, i + 2});
 			normals.insert(normals.end(), 3, (p2 - p1).cross(p3 - p1).unit());
 			colors.push_back(c1);
@@ -92,6 +311,7 @@ export namespace graphics
 
 		void addAlignedBox(const math::Vec3& p1, const math::Vec3& p2, const math::Vec4& color)
 		{
+			decompress();
 			const unsigned int j = static_cast<unsigned int>(vertices.size());
 			vertices.push_back(p1);
 			vertices.push_back({p1.x(), p1.y(), p2.z()});
@@ -101,6 +321,7 @@ export namespace graphics
 			vertices.push_back({p2.x(), p1.y(), p2.z()});
 			vertices.push_back({p2.x(), p2.y(), p1.z()});
 			vertices.push_back(p2);
+			extendBounds(j);
 			triangles.push_back({j, j + 1, j + 5});
 			triangles.push_back({j, j + 2, j + 3});
 			triangles.push_back({j, j + 3, j + 1});
@@ -119,6 +340,7 @@ export namespace graphics
 		void addAlignedCylinder(const math::Vec3 bottomCenter, const float radius,
 			const float height, const unsigned int subdivisions, const math::Vec4& color)
 		{
+			decompress();
 			const unsigned int j = static_cast<unsigned int>(vertices.size());
 			vertices.push_back(bottomCenter);
 			vertices.push_back(bottomCenter + math::Vec3(0.0f, height, 0.0f));
@@ -146,168 +368,717 @@ export namespace graphics
 				triangles.push_back({k + 1, k, k + 2});
 				triangles.push_back({k + 1, k + 2, k + 3});
 			}
+			extendBounds(j);
 			colors.insert(colors.end(), subdivisions * 4 + 2, color);
 		}
 
+		// The file is mapped into memory and its blocks are copied straight into the vectors.
 		void addBin(const std::string& filename)
 		{
+			decompress();
+			const BinFile bin(filename);
 			const unsigned int j = static_cast<unsigned int>(vertices.size());
-			std::ifstream file(filename, std::ios::binary);
-			if (file.fail())
+			vertices.insert(vertices.end(), bin.vertices.begin(), bin.vertices.end());
+			extendBounds(j);
+			colors.reserve(colors.size() + bin.colors.size());
+			for (const math::Vec3& color : bin.colors)
 			{
-				throw std::runtime_error("Couldn't open file '" + filename + "' for reading!");
+				colors.push_back({color.x(), color.y(), color.z(), 1.0f});
 			}
-			char ch;
-
-			int vertexCount;
-			file.read(reinterpret_cast<char*>(&vertexCount), sizeof(int));
-			math::Vec3* vertices = new math::Vec3[vertexCount];
-
-			file.read(&ch, 1);
-			if (ch != 'y')
+			normals.insert(normals.end(), bin.normals.begin(), bin.normals.end());
+			textureCoordinates.insert(textureCoordinates.end(), bin.textureCoordinates.begin(),
+				bin.textureCoordinates.end());
+			if (j == 0)
 			{
-				throw std::runtime_error("XYZ data not found in file '" + filename + "'!");
+				triangles.insert(triangles.end(), bin.triangles.begin(), bin.triangles.end());
+			}
+			else
+			{
+				triangles.reserve(triangles.size() + bin.triangles.size());
+				for (const std::array<unsigned int, 3>& triangle : bin.triangles)
+				{
+					triangles.push_back({triangle[0] + j, triangle[1] + j, triangle[2] + j});
+				}
 			}
+		}
 
-			file.read(&ch, 1);
-			math::Vec3* colors = nullptr;
-			if (ch == 'y')
+		// Positions and normals are decoded if the file stores them quantized. The bounds and
+		// meshlets that the file stores are used as they are, unless the mesh already had
+		// geometry before.
+		void addMeshFile(const std::string& filename)
+		{
+			decompress();
+			const MeshFile file(filename);
+			const unsigned int j = static_cast<unsigned int>(vertices.size());
+			const std::size_t vertexCount = file.header.vertexCount;
+			if (file.positions.empty())
+			{
+				vertices.reserve(j + vertexCount);
+				for (std::size_t i = 0; i < vertexCount; i++)
+				{
+					vertices.push_back(file.getPosition(i));
+				}
+			}
+			else
+			{
+				vertices.insert(vertices.end(), file.positions.begin(), file.positions.end());
+			}
+			colors.insert(colors.end(), file.colors.begin(), file.colors.end());
+			if (file.hasNormals())
 			{
-				colors = new math::Vec3[vertexCount];
+				normals.reserve(normals.size() + vertexCount);
+				for (std::size_t i = 0; i < vertexCount; i++)
+				{
+					normals.push_back(file.getNormal(i));
+				}
+			}
+			textureCoordinates.insert(textureCoordinates.end(), file.textureCoordinates.begin(),
+				file.textureCoordinates.end());
+			triangles.reserve(triangles.size() + file.header.triangleCount);
+			for (std::size_t i = 0; i < file.header.triangleCount; i++)
+			{
+				const std::array<unsigned int, 3> triangle = file.getTriangle(i);
+				triangles.push_back({triangle[0] + j, triangle[1] + j, triangle[2] + j});
 			}
 
-			file.read(&ch, 1);
-			math::Vec3* normals = nullptr;
-			if (ch == 'y')
+			if (j != 0)
+			{
+				extendBounds(j);
+				return;
+			}
+			bounds.minimum = file.header.minimum;
+			bounds.maximum = file.header.maximum;
+			bounds.center = file.header.center;
+			bounds.radius = file.header.radius;
+			meshlets.clear();
+			lods.clear();
+			for (const MeshletRecord& record : file.meshlets)
 			{
-				normals = new math::Vec3[vertexCount];
+				Meshlet& meshlet = meshlets.emplace_back();
+				meshlet.firstTriangle = record.firstTriangle;
+				meshlet.triangleCount = record.triangleCount;
+				meshlet.bounds.minimum = record.minimum;
+				meshlet.bounds.maximum = record.maximum;
+				meshlet.bounds.center = record.center;
+				meshlet.bounds.radius = record.radius;
+				meshlet.coneAxis = record.coneAxis;
+				meshlet.coneCutoff = record.coneCutoff;
 			}
+		}
+		// A mesh from importObj() or importPly(). The texture coordinates are only kept if the
+		// file had some.
+		void addImported(const ImportedMesh& mesh)
+		{
+			decompress();
+			const unsigned int j = static_cast<unsigned int>(vertices.size());
+			vertices.insert(vertices.end(), mesh.vertices.begin(), mesh.vertices.end());
+			extendBounds(j);
+			colors.insert(colors.end(), mesh.colors.begin(), mesh.colors.end());
+			normals.insert(normals.end(), mesh.normals.begin(), mesh.normals.end());
+			textureCoordinates.insert(textureCoordinates.end(), mesh.textureCoordinates.begin(),
+				mesh.textureCoordinates.end());
+			triangles.reserve(triangles.size() + mesh.triangles.size());
+			for (const std::array<unsigned int, 3>& triangle : mesh.triangles)
+			{
+				triangles.push_back({triangle[0] + j, triangle[1] + j, triangle[2] + j});
+			}
+		}
+		// .mesh files are loaded by addMeshFile(), .obj and .ply files by addImported() and
+		// anything else by addBin().
+		void addFile(const std::string& filename)
+		{
+			if (filename.ends_with(".mesh"))
+			{
+				addMeshFile(filename);
+			}
+			else if (filename.ends_with(".obj"))
+			{
+				addImported(importObj(filename));
+			}
+			else if (filename.ends_with(".ply"))
+			{
+				addImported(importPly(filename));
+			}
+			else
+			{
+				addBin(filename);
+			}
+		}
 
-			file.read(&ch, 1);
-			math::Vec2* textureCoordinates = nullptr;
-			if (ch == 'y')
+		bool isCompressed() const
+		{
+			return !compressed.positions.empty();
+		}
+		std::size_t getVertexCount() const
+		{
+			return isCompressed() ? compressed.positions.size() : vertices.size();
+		}
+		std::size_t getTriangleCount() const
+		{
+			return compressed.triangles.empty() ? triangles.size() : compressed.triangles.size();
+		}
+		math::Vec3 getVertex(const std::size_t i) const
+		{
+			if (!isCompressed())
+			{
+				return vertices[i];
+			}
+			const std::array<std::uint16_t, 3>& q = compressed.positions[i];
+			return compressed.origin + math::Vec3(q[0] * compressed.step.x(),
+				q[1] * compressed.step.y(), q[2] * compressed.step.z());
+		}
+		math::Vec4 getColor(const std::size_t i) const
+		{
+			return isCompressed() ? fromUnorm8(compressed.colors[i]) : colors[i];
+		}
+		math::Vec3 getNormal(const std::size_t i) const
+		{
+			return isCompressed() ? decodeOctahedral(compressed.normals[i]) : normals[i];
+		}
+		math::Vec2 getTextureCoordinate(const std::size_t i) const
+		{
+			if (!isCompressed())
+			{
+				return textureCoordinates[i];
+			}
+			const std::array<std::uint16_t, 2>& r = compressed.textureCoordinates[i];
+			return math::Vec2(fromHalf(r[0]), fromHalf(r[1]));
+		}
+		// Whether every vertex has a texture coordinate, which drawing with a texture needs.
+		bool hasTextureCoordinates() const
+		{
+			return (isCompressed() ? compressed.textureCoordinates.size() :
+				textureCoordinates.size()) == getVertexCount();
+		}
+		std::array<unsigned int, 3> getTriangle(const std::size_t i) const
+		{
+			if (compressed.triangles.empty())
 			{
-				textureCoordinates = new math::Vec2[vertexCount];
+				return triangles[i];
 			}
+			const std::array<std::uint16_t, 3>& triangle = compressed.triangles[i];
+			return {triangle[0], triangle[1], triangle[2]};
+		}
 
-			file.read(reinterpret_cast<char*>(vertices), vertexCount * 3 * sizeof(float));
-			for (std::size_t i = 0; i < static_cast<std::size_t>(vertexCount); i++)
+		// Switch to CompressedAttributes, which takes roughly a third of the memory. The
+		// bounds grow by the largest quantization error so that culling stays conservative.
+		// Editing the mesh afterwards decompresses it again first.
+		void compress()
+		{
+			if (isCompressed() || vertices.empty())
 			{
-				this->vertices.push_back(vertices[i]);
+				return;
 			}
-			delete vertices;
-			if (colors)
+			CompressedAttributes packed;
+			packed.origin = bounds.minimum;
+			packed.step = (bounds.maximum - bounds.minimum) / 65535.0f;
+			packed.positions.reserve(vertices.size());
+			for (const math::Vec3& vertex : vertices)
 			{
-				file.read(reinterpret_cast<char*>(colors), vertexCount * 3 * sizeof(float));
-				for (std::size_t i = 0; i < static_cast<std::size_t>(vertexCount); i++)
+				std::array<std::uint16_t, 3>& q = packed.positions.emplace_back();
+				for (std::size_t k = 0; k < 3; k++)
 				{
-					this->colors.push_back({colors[i].x(), colors[i].y(), colors[i].z(), 1.0f});
+					const float t = packed.step[k] > 0.0f ?
+						(vertex[k] - packed.origin[k]) / packed.step[k] : 0.0f;
+					q[k] = static_cast<std::uint16_t>(std::round(std::clamp(t, 0.0f, 65535.0f)));
 				}
-				delete colors;
 			}
-			if (normals)
+			packed.colors.reserve(colors.size());
+			for (const math::Vec4& color : colors)
 			{
-				file.read(reinterpret_cast<char*>(normals), vertexCount * 3 * sizeof(float));
-				this->normals.insert(this->normals.end(), normals, normals + vertexCount);
-				delete normals;
+				packed.colors.push_back(toUnorm8(color));
 			}
-			if (textureCoordinates)
+			packed.normals.reserve(normals.size());
+			for (const math::Vec3& normal : normals)
 			{
-				file.read(
-					reinterpret_cast<char*>(textureCoordinates),
-					vertexCount * 2 * sizeof(float)
-				);
-				this->textureCoordinates.insert(this->textureCoordinates.end(), textureCoordinates,
-					textureCoordinates + vertexCount);
-				delete textureCoordinates;
+				packed.normals.push_back(encodeOctahedral(normal));
 			}
+			packed.textureCoordinates.reserve(textureCoordinates.size());
+			for (const math::Vec2& r : textureCoordinates)
+			{
+				packed.textureCoordinates.push_back({toHalf(r.x()), toHalf(r.y())});
+			}
+			if (vertices.size() <= 65536)
+			{
+				packed.triangles.reserve(triangles.size());
+				for (const std::array<unsigned int, 3>& triangle : triangles)
+				{
+					packed.triangles.push_back({static_cast<std::uint16_t>(triangle[0]),
+						static_cast<std::uint16_t>(triangle[1]),
+						static_cast<std::uint16_t>(triangle[2])});
+				}
+				triangles = std::vector<std::array<unsigned int, 3>>();
+			}
+			vertices = std::vector<math::Vec3>();
+			colors = std::vector<math::Vec4>();
+			normals = std::vector<math::Vec3>();
+			textureCoordinates = std::vector<math::Vec2>();
+			compressed = std::move(packed);
 
-			int triangleCount;
-			file.read(reinterpret_cast<char*>(&triangleCount), sizeof(int));
-			unsigned int* triangles = new unsigned int[triangleCount * 3];
-			file.read(
-				reinterpret_cast<char*>(triangles),
-				triangleCount * 3 * sizeof(unsigned int)
-			);
-			for (std::size_t i = 0; i < static_cast<std::size_t>(triangleCount); i++)
+			const float error = compressed.step.norm() / 2.0f;
+			bounds.grow(error);
+			for (Meshlet& meshlet : meshlets)
 			{
-				this->triangles.push_back({
-					triangles[3 * i] + j,
-					triangles[3 * i + 1] + j,
-					triangles[3 * i + 2] + j
-				});
+				meshlet.bounds.grow(error);
+			}
+			for (TriangleMesh& lod : lods)
+			{
+				lod.compress();
+			}
+		}
+		void decompress()
+		{
+			if (!isCompressed())
+			{
+				return;
+			}
+			const std::size_t vertexCount = getVertexCount();
+			std::vector<math::Vec3> decodedVertices(vertexCount);
+			std::vector<math::Vec4> decodedColors(compressed.colors.size());
+			std::vector<math::Vec3> decodedNormals(compressed.normals.size());
+			std::vector<math::Vec2> decodedTextureCoordinates(compressed.textureCoordinates.size());
+			for (std::size_t i = 0; i < vertexCount; i++)
+			{
+				decodedVertices[i] = getVertex(i);
+			}
+			for (std::size_t i = 0; i < decodedColors.size(); i++)
+			{
+				decodedColors[i] = getColor(i);
+			}
+			for (std::size_t i = 0; i < decodedNormals.size(); i++)
+			{
+				decodedNormals[i] = getNormal(i);
+			}
+			for (std::size_t i = 0; i < decodedTextureCoordinates.size(); i++)
+			{
+				decodedTextureCoordinates[i] = getTextureCoordinate(i);
+			}
+			if (!compressed.triangles.empty())
+			{
+				triangles.resize(compressed.triangles.size());
+				for (std::size_t i = 0; i < triangles.size(); i++)
+				{
+					triangles[i] = getTriangle(i);
+				}
+			}
+			vertices = std::move(decodedVertices);
+			colors = std::move(decodedColors);
+			normals = std::move(decodedNormals);
+			textureCoordinates = std::move(decodedTextureCoordinates);
+			compressed = CompressedAttributes();
+			updateBounds();
+			for (TriangleMesh& lod : lods)
+			{
+				lod.decompress();
 			}
-			delete triangles;
-			file.close();
 		}
 
-		void prerender(Framebuffer& framebuffer, const math::PinholeCamera& camera) const
+		// Grow the bounds to include every vertex from first on. The new vertices aren't part of
+		// any meshlet.
+		void extendBounds(const std::size_t first)
+		{
+			for (std::size_t i = first; i < vertices.size(); i++)
+			{
+				bounds.add(vertices[i]);
+			}
+			meshlets.clear();
+			lods.clear();
+		}
+		void updateBounds()
+		{
+			decompress();
+			bounds = Bounds();
+			for (const math::Vec3& vertex : vertices)
+			{
+				bounds.add(vertex);
+			}
+			updateMeshlets();
+		}
+
+		// Reorder the triangles into meshlets of up to maxTriangles triangles each. Every
+		// meshlet grows outwards from its first triangle through shared vertices, so that its
+		// triangles end up close together and facing similar directions.
+		void buildMeshlets(const std::size_t maxTriangles = 64)
 		{
-			for (const std::array<unsigned int, 3>& triangle : triangles)
+			decompress();
+			std::vector<std::vector<std::size_t>> adjacency(vertices.size());
+			for (std::size_t i = 0; i < triangles.size(); i++)
 			{
-				if (texture)
+				for (const unsigned int vertex : triangles[i])
 				{
-					framebuffer.prerenderTriangle(camera, vertices[triangle[0]],
-						vertices[triangle[1]], vertices[triangle[2]]);
+					adjacency[vertex].push_back(i);
 				}
-				else if (colors[triangle[0]].a() >= 1.0f && colors[triangle[1]].a() >= 1.0f &&
-					colors[triangle[2]].a() >= 1.0f)
+			}
+
+			std::vector<bool> used(triangles.size(), false);
+			std::vector<std::array<unsigned int, 3>> ordered;
+			ordered.reserve(triangles.size());
+			std::vector<std::size_t> queue;
+			meshlets.clear();
+			for (std::size_t seed = 0; seed < triangles.size(); seed++)
+			{
+				if (used[seed])
+				{
+					continue;
+				}
+
+				Meshlet& meshlet = meshlets.emplace_back();
+				meshlet.firstTriangle = ordered.size();
+				queue.assign(1, seed);
+				for (std::size_t i = 0; i < queue.size() && meshlet.triangleCount < maxTriangles;
+					i++)
 				{
-					framebuffer.prerenderTriangle(camera, vertices[triangle[0]],
-						vertices[triangle[1]], vertices[triangle[2]]);
+					const std::size_t triangle = queue[i];
+					if (used[triangle])
+					{
+						continue;
+					}
+					used[triangle] = true;
+					ordered.push_back(triangles[triangle]);
+					meshlet.triangleCount++;
+					for (const unsigned int vertex : triangles[triangle])
+					{
+						for (const std::size_t neighbour : adjacency[vertex])
+						{
+							if (!used[neighbour])
+							{
+								queue.push_back(neighbour);
+							}
+						}
+					}
 				}
 			}
+			triangles = std::move(ordered);
+			updateMeshlets();
 		}
-		void render(Framebuffer& framebuffer, const math::PinholeCamera& camera,
-			std::vector<DirectionalLight>& directionalLights,
-			std::vector<PointLight>& pointLights) const
+		// Recompute the bounding spheres and normal cones of the meshlets.
+		void updateMeshlets()
 		{
-			prerender(framebuffer, camera);
-			if (texture)
+			decompress();
+			for (Meshlet& meshlet : meshlets)
 			{
-				for (const std::array<unsigned int, 3>& triangle : triangles)
+				meshlet.bounds = Bounds();
+				std::vector<math::Vec3> faceNormals;
+				math::Vec3 axis = math::Vec3(0.0f);
+				for (std::size_t i = meshlet.firstTriangle;
+					i < meshlet.firstTriangle + meshlet.triangleCount; i++)
+				{
+					const std::array<unsigned int, 3>& triangle = triangles[i];
+					for (const unsigned int vertex : triangle)
+					{
+						meshlet.bounds.add(vertices[vertex]);
+					}
+					// Degenerate triangles are always culled, so they don't widen the cone.
+					const math::Vec3 normal = (vertices[triangle[1]] - vertices[triangle[0]]).cross(
+						vertices[triangle[2]] - vertices[triangle[0]]);
+					if (normal.norm() > 0.0f)
+					{
+						faceNormals.push_back(normal.unit());
+						axis += faceNormals.back();
+					}
+				}
+
+				meshlet.coneAxis = axis.norm() > 0.0f ? axis.unit() : math::Vec3(0.0f);
+				float minimumDot = 1.0f;
+				for (const math::Vec3& normal : faceNormals)
+				{
+					minimumDot = std::min(minimumDot, normal.dot(meshlet.coneAxis));
+				}
+				meshlet.coneCutoff = minimumDot > 0.0f ?
+					std::sqrt(1.0f - minimumDot * minimumDot) : 2.0f;
+			}
+		}
+		// The finest level of detail with at most one triangle per lodTriangleArea pixels of the
+		// projected bounding sphere, or the coarsest level if none is that sparse.
+		const TriangleMesh& selectLod(const math::PinholeCamera& camera,
+			const Transform& transform = Transform()) const
+		{
+			static constexpr float lodTriangleArea = 8.0f;
+			// The ratio of radius and distance is the same in object space as in world space.
+			const float distance = (bounds.center - transform.toObjectSpace(camera.center)).norm();
+			if (lods.empty() || distance <= bounds.radius)
+			{
+				return *this;
+			}
+			const float radius = bounds.radius * camera.getFocalLength() / distance;
+			const float area = std::numbers::pi_v<float> * radius * radius;
+			const TriangleMesh* lod = this;
+			for (const TriangleMesh& coarser : lods)
+			{
+				if (static_cast<float>(lod->getTriangleCount()) * lodTriangleArea <= area)
+				{
+					break;
+				}
+				lod = &coarser;
+			}
+			return *lod;
+		}
+
+		// Whether any part of the mesh may be visible to the camera.
+		bool isVisible(const math::PinholeCamera& camera,
+			const Transform& transform = Transform()) const
+		{
+			return bounds.intersects(transform.toObjectSpace(camera.getFrustumPlanes()));
+		}
+
+		// Only triangles that are fully opaque take part in the depth prepass.
+		bool isOpaque(const std::array<unsigned int, 3>& triangle,
+			const Framebuffer* texture) const
+		{
+			return texture || (getColor(triangle[0]).a() >= 1.0f &&
+				getColor(triangle[1]).a() >= 1.0f && getColor(triangle[2]).a() >= 1.0f);
+		}
+
+		// Every vertex is transformed once, no matter how many triangles share it. This is the
+		// only place where vertices are moved into world space.
+		std::vector<TransformedVertex> transform(const math::PinholeCamera& camera,
+			const Transform& toWorld = Transform()) const
+		{
+			static constexpr std::size_t chunkSize = 1024;
+			const std::size_t vertexCount = getVertexCount();
+			std::vector<TransformedVertex> transformed(vertexCount);
+			getThreadPool().parallelFor((vertexCount + chunkSize - 1) / chunkSize,
+				[&](const std::size_t chunk)
 				{
-					framebuffer.renderTriangle(
-						camera, *texture,
-						vertices[triangle[0]], vertices[triangle[1]], vertices[triangle[2]],
-						textureCoordinates[triangle[0]],
-						textureCoordinates[triangle[1]],
-						textureCoordinates[triangle[2]],
-						normals[triangle[0]], normals[triangle[1]], normals[triangle[2]],
-						directionalLights, pointLights, material
-					);
+					const std::size_t end = std::min((chunk + 1) * chunkSize, vertexCount);
+					for (std::size_t i = chunk * chunkSize; i < end; i++)
+					{
+						transformed[i] = transformVertex(camera,
+							toWorld.toWorldSpace(getVertex(i)));
+					}
 				}
+			);
+			return transformed;
+		}
+
+		// Clipping may split a triangle into several setups, so each setup records which triangle
+		// it belongs to. The setups stay in the order of the triangles, and invisible ones are
+		// left out. The depth prepass and the shading pass share the setups of a view.
+		std::vector<TriangleSetup> setup(const Framebuffer& framebuffer,
+			const math::PinholeCamera& camera, const Transform& toWorld = Transform()) const
+		{
+			static constexpr std::size_t chunkSize = 256;
+			const std::vector<TransformedVertex> transformed = transform(camera, toWorld);
+			const auto setupRange = [&](const std::size_t first, const std::size_t last,
+				std::vector<TriangleSetup>& setups)
+			{
+				if (compressed.triangles.empty())
+				{
+					framebuffer.setupTriangles(camera, transformed, triangles, first, last,
+						setups);
+				}
+				else
+				{
+					framebuffer.setupTriangles(camera, transformed, compressed.triangles, first,
+						last, setups);
+				}
+			};
+			std::vector<std::vector<TriangleSetup>> chunks;
+			if (meshlets.empty())
+			{
+				const std::size_t triangleCount = getTriangleCount();
+				chunks.resize((triangleCount + chunkSize - 1) / chunkSize);
+				getThreadPool().parallelFor(chunks.size(), [&](const std::size_t chunk)
+					{
+						setupRange(chunk * chunkSize,
+							std::min((chunk + 1) * chunkSize, triangleCount), chunks[chunk]);
+					}
+				);
 			}
 			else
 			{
-				for (const std::array<unsigned int, 3>& triangle : triangles)
+				// Meshlets that face away from the camera or are outside of its frustum never
+				// get to per-triangle setup. The meshlets are tested in object space.
+				const std::array<math::Vec4, 5> planes =
+					toWorld.toObjectSpace(camera.getFrustumPlanes());
+				const math::Vec3 cameraPosition = toWorld.toObjectSpace(camera.center);
+				chunks.resize(meshlets.size());
+				getThreadPool().parallelFor(chunks.size(), [&](const std::size_t i)
+					{
+						const Meshlet& meshlet = meshlets[i];
+						if (!meshlet.isBackFacing(cameraPosition) &&
+							meshlet.bounds.intersects(planes))
+						{
+							setupRange(meshlet.firstTriangle,
+								meshlet.firstTriangle + meshlet.triangleCount, chunks[i]);
+						}
+					}
+				);
+			}
+
+			std::vector<TriangleSetup> setups;
+			for (const std::vector<TriangleSetup>& chunk : chunks)
+			{
+				setups.insert(setups.end(), chunk.begin(), chunk.end());
+			}
+			return setups;
+		}
+
+		void prerender(Framebuffer& framebuffer, const math::PinholeCamera& camera,
+			const DrawParameters& draw) const
+		{
+			if (!isVisible(camera, draw.transform))
+			{
+				return;
+			}
+			const TriangleMesh& lod = selectLod(camera, draw.transform);
+			if (&lod != this)
+			{
+				lod.prerender(framebuffer, camera, draw);
+				return;
+			}
+			if (draw.texture && !hasTextureCoordinates())
+			{
+				prerender(framebuffer, camera, {draw.transform, draw.material, nullptr});
+				return;
+			}
+			const std::vector<TriangleSetup> setups = setup(framebuffer, camera, draw.transform);
+			framebuffer.binTriangles(setups);
+			getThreadPool().parallelFor(framebuffer.getTileCount(), [&](const std::size_t i)
 				{
-					framebuffer.renderTriangle(
-						camera,
-						vertices[triangle[0]], vertices[triangle[1]], vertices[triangle[2]],
-						colors[triangle[0]], colors[triangle[1]], colors[triangle[2]],
-						normals[triangle[0]], normals[triangle[1]], normals[triangle[2]],
-						directionalLights, pointLights, material
-					);
+					const Tile tile = framebuffer.getTile(i);
+					for (const std::uint32_t j : framebuffer.getBin(i))
+					{
+						if (isOpaque(getTriangle(setups[j].triangle), draw.texture))
+						{
+							framebuffer.prerenderTriangle(setups[j], tile);
+						}
+					}
 				}
+			);
+		}
+		void prerender(Framebuffer& framebuffer, const math::PinholeCamera& camera) const
+		{
+			prerender(framebuffer, camera, {Transform(), material, texture});
+		}
+		void renderTriangle(Framebuffer& framebuffer, const TriangleSetup& setup,
+			const Tile& tile, const RenderContext& context, const DrawParameters& draw) const
+		{
+			const std::array<unsigned int, 3> triangle = getTriangle(setup.triangle);
+			const math::Mat3& rotation = draw.transform.rotation;
+			if (draw.texture)
+			{
+				framebuffer.renderTriangle(
+					setup, tile, context, *draw.texture,
+					draw.transform.toWorldSpace(getVertex(triangle[0])),
+					draw.transform.toWorldSpace(getVertex(triangle[1])),
+					draw.transform.toWorldSpace(getVertex(triangle[2])),
+					getTextureCoordinate(triangle[0]), getTextureCoordinate(triangle[1]),
+					getTextureCoordinate(triangle[2]),
+					rotation * getNormal(triangle[0]), rotation * getNormal(triangle[1]),
+					rotation * getNormal(triangle[2]),
+					draw.material
+				);
+			}
+			else
+			{
+				framebuffer.renderTriangle(
+					setup, tile, context,
+					getColor(triangle[0]), getColor(triangle[1]), getColor(triangle[2]),
+					rotation * getNormal(triangle[0]), rotation * getNormal(triangle[1]),
+					rotation * getNormal(triangle[2]),
+					draw.material
+				);
 			}
 		}
+		// The screen is split into tiles which are rendered in parallel. Every tile runs the
+		// depth prepass and the shading pass over its own bin of triangles, so no two threads
+		// ever touch the same pixel.
+		void render(Framebuffer& framebuffer, const RenderContext& context,
+			const DrawParameters& draw, const ShadingMode mode = ShadingMode::visibility) const
+		{
+			if (!isVisible(context.camera, draw.transform))
+			{
+				return;
+			}
+			const TriangleMesh& lod = selectLod(context.camera, draw.transform);
+			if (&lod != this)
+			{
+				lod.render(framebuffer, context, draw, mode);
+				return;
+			}
+			// Without texture coordinates the texture is ignored, down to resolveVisibility().
+			if (draw.texture && !hasTextureCoordinates())
+			{
+				render(framebuffer, context, {draw.transform, draw.material, nullptr}, mode);
+				return;
+			}
+			const std::vector<TriangleSetup> setups = setup(framebuffer, context.camera,
+				draw.transform);
+			framebuffer.binTriangles(setups);
+			getThreadPool().parallelFor(framebuffer.getTileCount(), [&](const std::size_t i)
+				{
+					const Tile tile = framebuffer.getTile(i);
+					const std::vector<std::uint32_t>& bin = framebuffer.getBin(i);
+					if (mode == ShadingMode::forward)
+					{
+						for (const std::uint32_t j : bin)
+						{
+							if (isOpaque(getTriangle(setups[j].triangle), draw.texture))
+							{
+								framebuffer.prerenderTriangle(setups[j], tile);
+							}
+						}
+						for (const std::uint32_t j : bin)
+						{
+							renderTriangle(framebuffer, setups[j], tile, context, draw);
+						}
+						return;
+					}
+
+					thread_local std::vector<std::uint32_t> visibility(
+						Framebuffer::tileSize * Framebuffer::tileSize);
+					std::fill(visibility.begin(), visibility.end(), Framebuffer::noTriangle);
+					for (const std::uint32_t j : bin)
+					{
+						if (isOpaque(getTriangle(setups[j].triangle), draw.texture))
+						{
+							framebuffer.prerenderTriangle(setups[j], tile, j, visibility.data());
+						}
+					}
+					framebuffer.resolveVisibility(tile, visibility.data(), *this, draw, setups,
+						context);
+					for (const std::uint32_t j : bin)
+					{
+						if (!isOpaque(getTriangle(setups[j].triangle), draw.texture))
+						{
+							renderTriangle(framebuffer, setups[j], tile, context, draw);
+						}
+					}
+				}
+			);
+		}
+		void render(Framebuffer& framebuffer, const RenderContext& context,
+			const ShadingMode mode = ShadingMode::visibility) const
+		{
+			render(framebuffer, context, {Transform(), material, texture}, mode);
+		}
 
 		void translate(const math::Vec3& direction)
 		{
+			decompress();
 			for (math::Vec3& vertex : vertices)
 			{
 				vertex += direction;
 			}
+			bounds.translate(direction);
+			for (Meshlet& meshlet : meshlets)
+			{
+				meshlet.bounds.translate(direction);
+			}
+			for (TriangleMesh& lod : lods)
+			{
+				lod.translate(direction);
+			}
 		}
 		math::Vec3 getCenter() const
 		{
 			math::Vec3 center = math::Vec3(0.0f);
-			for (const math::Vec3& vertex : vertices)
+			for (std::size_t i = 0; i < getVertexCount(); i++)
 			{
-				center += vertex;
+				center += getVertex(i);
 			}
-			return center / static_cast<float>(vertices.size());
+			return center / static_cast<float>(getVertexCount());
 		}
 		void setCenter(const math::Vec3& center)
 		{
@@ -316,10 +1087,21 @@ export namespace graphics
 
 		void scale(const math::Vec3& center, const float multiplier)
 		{
+			decompress();
 			for (math::Vec3& vertex : vertices)
 			{
 				vertex = (vertex - center) * multiplier + center;
 			}
+			// Scaling leaves the directions of the normals of the triangles alone.
+			bounds.scale(center, multiplier);
+			for (Meshlet& meshlet : meshlets)
+			{
+				meshlet.bounds.scale(center, multiplier);
+			}
+			for (TriangleMesh& lod : lods)
+			{
+				lod.scale(center, multiplier);
+			}
 		}
 		void scale(const float multiplier)
 		{
@@ -328,11 +1110,11 @@ export namespace graphics
 		float getSize(const math::Vec3& center) const
 		{
 			float size = 0.0f;
-			for (const math::Vec3& vertex : vertices)
+			for (std::size_t i = 0; i < getVertexCount(); i++)
 			{
-				size += (vertex - center).norm();
+				size += (getVertex(i) - center).norm();
 			}
-			return size / static_cast<float>(vertices.size());
+			return size / static_cast<float>(getVertexCount());
 		}
 		float getSize() const
 		{
@@ -349,12 +1131,24 @@ export namespace graphics
 
 		void rotateAboutAxis(const math::Vec3& origin, const math::Vec3& axis, const float theta)
 		{
+			decompress();
+			// The box has to be rebuilt from the vertices, but the sphere just rotates along.
+			Bounds rotated;
 			for (std::size_t i = 0; i < vertices.size(); i++)
 			{
 				const math::Vec3 out = (vertices[i] + normals[i]).rotatedAboutAxis(origin, axis,
 					theta);
 				vertices[i].rotateAboutAxis(origin, axis, theta);
 				normals[i] = out - vertices[i];
+				rotated.add(vertices[i]);
+			}
+			rotated.center = bounds.center.rotatedAboutAxis(origin, axis, theta);
+			rotated.radius = bounds.radius;
+			bounds = rotated;
+			updateMeshlets();
+			for (TriangleMesh& lod : lods)
+			{
+				lod.rotateAboutAxis(origin, axis, theta);
 			}
 		}
 		void rotateAboutAxis(const math::Vec3& axis, const float theta)
@@ -366,4 +1160,73 @@ export namespace graphics
 			rotateAboutAxis(start, end - start, theta);
 		}
 	};
+
+	// A mesh that is drawn with its own transform, material, and texture. Any number of instances
+	// can share the same geometry, which never gets copied or modified by them. The texture is
+	// only used if the geometry has texture coordinates.
+	struct MeshInstance
+	{
+		std::shared_ptr<const TriangleMesh> geometry;
+		Transform transform;
+		Material material;
+		const Framebuffer* texture;
+
+		explicit MeshInstance(std::shared_ptr<const TriangleMesh> geometry) :
+			geometry(geometry), material(geometry->material), texture(geometry->texture) {}
+		MeshInstance(std::shared_ptr<const TriangleMesh> geometry, const Material& material) :
+			geometry(geometry), material(material), texture(geometry->texture) {}
+		MeshInstance(std::shared_ptr<const TriangleMesh> geometry, const Framebuffer* texture,
+			const Material& material) :
+			geometry(geometry), material(material), texture(texture) {}
+
+		void prerender(Framebuffer& framebuffer, const math::PinholeCamera& camera) const
+		{
+			geometry->prerender(framebuffer, camera, {transform, material, texture});
+		}
+		void render(Framebuffer& framebuffer, const RenderContext& context,
+			const ShadingMode mode = ShadingMode::visibility) const
+		{
+			geometry->render(framebuffer, context, {transform, material, texture}, mode);
+		}
+
+		void translate(const math::Vec3& direction)
+		{
+			transform.translation += direction;
+		}
+		math::Vec3 getCenter() const
+		{
+			return transform.toWorldSpace(geometry->getCenter());
+		}
+		void setCenter(const math::Vec3& center)
+		{
+			translate(center - getCenter());
+		}
+
+		// The multiplier has to be positive, or the triangles would end up facing backwards.
+		void scale(const math::Vec3& center, const float multiplier)
+		{
+			transform.scale *= multiplier;
+			transform.translation = (transform.translation - center) * multiplier + center;
+		}
+		void scale(const float multiplier)
+		{
+			scale(getCenter(), multiplier);
+		}
+
+		void rotateAboutAxis(const math::Vec3& origin, const math::Vec3& axis, const float theta)
+		{
+			const math::Mat3 axes = math::axesZ(axis.unit());
+			const math::Mat3 rotation = axes.transpose() * math::rotationZ(theta) * axes;
+			transform.rotation = rotation * transform.rotation;
+			transform.translation = rotation * (transform.translation - origin) + origin;
+		}
+		void rotateAboutAxis(const math::Vec3& axis, const float theta)
+		{
+			rotateAboutAxis(getCenter(), axis, theta);
+		}
+		void rotateAboutSegment(const math::Vec3& start, const math::Vec3& end, const float theta)
+		{
+			rotateAboutAxis(start, end - start, theta);
+		}
+	};
 }
@@ -1,10 +1,19 @@
 export module graphics;
 
 export import :Framebuffer;
+export import :Quantization;
+export import :MappedFile;
+export import :BinFile;
+export import :MeshFile;
+export import :MeshImport;
 export import :TriangleMesh;
+export import :Simplification;
+export import :MeshOptimization;
+export import :MeshConverter;
 export import :DirectionalLight;
 export import :PointLight;
 export import :Material;
 export import :light;
 export import :CubeMap;
 export import :Window;
+export import :ThreadPool;
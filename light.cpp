@@ -1,5 +1,9 @@
+module;
+#include <immintrin.h>
+
 export module graphics:light;
 
+import :Framebuffer;
 import :DirectionalLight;
 import :PointLight;
 import :Material;
@@ -7,15 +11,55 @@ import :CubeMap;
 
 import math;
 
+import <array>;
 import <vector>;
+import <algorithm>;
 import <cmath>;
+import <cstddef>;
 
-export namespace graphics
+namespace graphics
 {
-	// Global variables as a workaround to what I believe is an MSVC modules bug, although I might
-	// just be dumb.
-	CubeMap* reflectionMap;
+#ifdef __AVX2__
+	__m256 power(__m256 base, unsigned int exponent)
+	{
+		__m256 result = _mm256_set1_ps(1.0f);
+		while (exponent)
+		{
+			if (exponent & 1)
+			{
+				result = _mm256_mul_ps(result, base);
+			}
+			exponent >>= 1;
+			base = _mm256_mul_ps(base, base);
+		}
+		return result;
+	}
+	// Same as above, but the multiplications are unrolled for an exponent known at compile time.
+	template<unsigned int exponent>
+	__m256 power(const __m256 base)
+	{
+		if constexpr (exponent == 0)
+		{
+			return _mm256_set1_ps(1.0f);
+		}
+		else if constexpr (exponent == 1)
+		{
+			return base;
+		}
+		else if constexpr (exponent % 2 == 0)
+		{
+			return power<exponent / 2>(_mm256_mul_ps(base, base));
+		}
+		else
+		{
+			return _mm256_mul_ps(base, power<exponent / 2>(_mm256_mul_ps(base, base)));
+		}
+	}
+#endif
+}
 
+export namespace graphics
+{
 	// Explanation for lighting factors:
 	//  kA - ambience factor. Corresponds to the minimum possible value of kD
 	//  kD - diffuse lighting factor
@@ -27,10 +71,15 @@ export namespace graphics
 	//  kR - how reflective the surface is
 	//  kF - fresnel factor
 	//  kU - combination of kR and kF
+	//
+	// getVisibility(i) returns how visible the surface point is to point light i. Reflections
+	// are looked up in reflectionMap, if there is one.
+	template<typename F>
 	math::Vec4 light(const math::Vec4& color, const math::Vec3& normal,
 		const math::Vec3& surfacePoint, const math::Vec3& cameraPosition,
-		std::vector<DirectionalLight>& directionalLights, std::vector<PointLight>& pointLights,
-		const float w, const Material& material)
+		const std::vector<DirectionalLight>& directionalLights,
+		const std::vector<PointLight>& pointLights, F getVisibility,
+		const CubeMap* reflectionMap, std::size_t& reflectionHit, const Material& material)
 	{
 		float kD = material.kA;
 		math::Vec3 kS = math::Vec3(0.0f);
@@ -45,9 +94,10 @@ export namespace graphics
 					directionalLight.strength);
 			}
 
-			for (PointLight& pointLight : pointLights)
+			for (std::size_t i = 0; i < pointLights.size(); i++)
 			{
-				float visibility = pointLight.shadowMap.getVisibility(w);
+				const PointLight& pointLight = pointLights[i];
+				const float visibility = getVisibility(i);
 				if (visibility != 0.0f)
 				{
 					math::Vec3 direction = pointLight.getPosition() - surfacePoint;
@@ -67,9 +117,10 @@ export namespace graphics
 					directionalLight.specularColor;
 			}
 
-			for (PointLight& pointLight : pointLights)
+			for (std::size_t i = 0; i < pointLights.size(); i++)
 			{
-				float visibility = pointLight.shadowMap.getVisibility(w);
+				const PointLight& pointLight = pointLights[i];
+				const float visibility = getVisibility(i);
 				if (visibility != 0.0f)
 				{
 					math::Vec3 direction = pointLight.getPosition() - surfacePoint;
@@ -92,9 +143,10 @@ export namespace graphics
 					directionalLight.specularColor;
 			}
 
-			for (PointLight& pointLight : pointLights)
+			for (std::size_t i = 0; i < pointLights.size(); i++)
 			{
-				float visibility = pointLight.shadowMap.getVisibility(w);
+				const PointLight& pointLight = pointLights[i];
+				const float visibility = getVisibility(i);
 				if (visibility != 0.0f)
 				{
 					math::Vec3 direction = pointLight.getPosition() - surfacePoint;
@@ -120,7 +172,7 @@ export namespace graphics
 		{
 			float kU = material.kR - material.kF * ray.dot(normal);
 			result += (1.0f - kU) * kD * subcolor + kU *
-				math::Vec3(reflectionMap->lookup(reflectedRay));
+				math::Vec3(reflectionMap->lookup(reflectedRay, reflectionHit));
 		}
 
 		if (result.max() > 1.0f)
@@ -129,4 +181,320 @@ export namespace graphics
 		}
 		return math::Vec4(result.r(), result.g(), result.b(), 1.0f) * color.a();
 	}
+	math::Vec4 light(const math::Vec4& color, const math::Vec3& normal,
+		const math::Vec3& surfacePoint, const RenderContext& context,
+		std::vector<CubeMapSampler>& shadowSamplers, std::size_t& reflectionHit, const float w,
+		const Material& material)
+	{
+		return light(color, normal, surfacePoint, context.camera.center,
+			context.directionalLights, context.pointLights, [&](const std::size_t i)
+			{
+				return context.pointLights[i].shadowMap.getVisibility(shadowSamplers[i], w);
+			},
+			context.reflectionMap, reflectionHit, material
+		);
+	}
+
+	// Inputs of up to 8 fragments that get lit together, stored as a structure of arrays. The
+	// shadow map visibility of each fragment is looked up by whoever adds the fragment, since
+	// that's where the shadow map coordinates are known.
+	struct FragmentPacket
+	{
+		static constexpr std::size_t size = 8;
+
+		std::array<math::Vector<size>, 4> color{};
+		std::array<math::Vector<size>, 3> normal{};
+		std::array<math::Vector<size>, 3> surfacePoint{};
+		// Visibility of every fragment for every point light.
+		std::vector<math::Vector<size>> visibility;
+		std::size_t count = 0;
+
+		// Returns the lane of the fragment.
+		std::size_t add(const math::Vec4& color, const math::Vec3& normal,
+			const math::Vec3& surfacePoint)
+		{
+			for (std::size_t i = 0; i < 4; i++)
+			{
+				this->color[i][count] = color[i];
+			}
+			for (std::size_t i = 0; i < 3; i++)
+			{
+				this->normal[i][count] = normal[i];
+				this->surfacePoint[i][count] = surfacePoint[i];
+			}
+			return count++;
+		}
+	};
+
+	// Scratch state for lighting fragments. Every thread has its own, so lights and cube maps are
+	// only ever read from while rendering.
+	struct ShadingScratch
+	{
+		std::vector<CubeMapSampler> shadowSamplers;
+		FragmentPacket packet;
+		// Pixel of every fragment in the packet, as an offset from the row it gets written to.
+		std::array<int, FragmentPacket::size> columns;
+		std::size_t reflectionHit = 0;
+	};
+
+	// The cube map hints are reset so that the result doesn't depend on what the thread happened
+	// to render before.
+	ShadingScratch& getShadingScratch(const std::size_t pointLightCount)
+	{
+		thread_local ShadingScratch scratch;
+		scratch.shadowSamplers.resize(pointLightCount);
+		for (CubeMapSampler& sampler : scratch.shadowSamplers)
+		{
+			sampler.previousHit = 0;
+		}
+		scratch.packet.visibility.resize(pointLightCount);
+		scratch.packet.count = 0;
+		scratch.reflectionHit = 0;
+		return scratch;
+	}
+
+	// Same as light(), but for every fragment of the packet at once. Lanes past packet.count are
+	// left alone. If preset isn't null, it's used instead of material, which lets the compiler
+	// drop the branches the preset doesn't take and fold its factors into constants.
+	template<const Material* preset>
+	void light(const FragmentPacket& packet, const RenderContext& context,
+		std::size_t& reflectionHit, const Material& dynamicMaterial,
+		std::array<math::Vec4, FragmentPacket::size>& colors)
+	{
+		const Material& material = [&]() -> const Material&
+		{
+			if constexpr (preset != nullptr)
+			{
+				return *preset;
+			}
+			else
+			{
+				return dynamicMaterial;
+			}
+		}();
+		const math::Vec3& cameraPosition = context.camera.center;
+		const std::vector<DirectionalLight>& directionalLights = context.directionalLights;
+		const std::vector<PointLight>& pointLights = context.pointLights;
+		const CubeMap* reflectionMap = context.reflectionMap;
+#ifdef __AVX2__
+		const auto load = [](const math::Vector<FragmentPacket::size>& v)
+		{
+			return _mm256_loadu_ps(&v[0]);
+		};
+		const auto dot = [](const __m256 x1, const __m256 y1, const __m256 z1, const __m256 x2,
+			const __m256 y2, const __m256 z2)
+		{
+			return _mm256_fmadd_ps(x1, x2, _mm256_fmadd_ps(y1, y2, _mm256_mul_ps(z1, z2)));
+		};
+		const auto specularPower = [&](const __m256 base)
+		{
+			if constexpr (preset != nullptr)
+			{
+				return power<preset->kE>(base);
+			}
+			else
+			{
+				return power(base, material.kE);
+			}
+		};
+		const __m256 zero = _mm256_setzero_ps();
+		const __m256 one = _mm256_set1_ps(1.0f);
+
+		const __m256 nx = load(packet.normal[0]);
+		const __m256 ny = load(packet.normal[1]);
+		const __m256 nz = load(packet.normal[2]);
+		const __m256 sx = load(packet.surfacePoint[0]);
+		const __m256 sy = load(packet.surfacePoint[1]);
+		const __m256 sz = load(packet.surfacePoint[2]);
+
+		__m256 rx = _mm256_sub_ps(_mm256_set1_ps(cameraPosition.x()), sx);
+		__m256 ry = _mm256_sub_ps(_mm256_set1_ps(cameraPosition.y()), sy);
+		__m256 rz = _mm256_sub_ps(_mm256_set1_ps(cameraPosition.z()), sz);
+		const __m256 rl = _mm256_sqrt_ps(dot(rx, ry, rz, rx, ry, rz));
+		rx = _mm256_div_ps(rx, rl);
+		ry = _mm256_div_ps(ry, rl);
+		rz = _mm256_div_ps(rz, rl);
+		const __m256 rn = dot(rx, ry, rz, nx, ny, nz);
+		const __m256 rs = _mm256_div_ps(_mm256_add_ps(rn, rn),
+			_mm256_sqrt_ps(dot(nx, ny, nz, nx, ny, nz)));
+		const __m256 fx = _mm256_fmsub_ps(rs, nx, rx);
+		const __m256 fy = _mm256_fmsub_ps(rs, ny, ry);
+		const __m256 fz = _mm256_fmsub_ps(rs, nz, rz);
+
+		const bool specularOnly = material.kR == 1.0f;
+		const bool diffuseOnly = !specularOnly && material.kT == 0.0f;
+		__m256 kD = _mm256_set1_ps(material.kA);
+		std::array<__m256, 3> kS = {zero, zero, zero};
+
+		for (const DirectionalLight& directionalLight : directionalLights)
+		{
+			const math::Vec3& d = directionalLight.direction;
+			if (!specularOnly)
+			{
+				kD = _mm256_add_ps(kD, _mm256_max_ps(zero, _mm256_mul_ps(dot(
+					_mm256_set1_ps(d.x()), _mm256_set1_ps(d.y()), _mm256_set1_ps(d.z()),
+					nx, ny, nz), _mm256_set1_ps(directionalLight.strength))));
+			}
+			if (!diffuseOnly)
+			{
+				const __m256 specular = _mm256_mul_ps(specularPower(_mm256_max_ps(zero, dot(
+					_mm256_set1_ps(d.x()), _mm256_set1_ps(d.y()), _mm256_set1_ps(d.z()),
+					fx, fy, fz))),
+					_mm256_set1_ps(directionalLight.specularStrength * material.kT));
+				for (std::size_t i = 0; i < 3; i++)
+				{
+					kS[i] = _mm256_fmadd_ps(specular,
+						_mm256_set1_ps(directionalLight.specularColor[i]), kS[i]);
+				}
+			}
+		}
+
+		for (std::size_t j = 0; j < pointLights.size(); j++)
+		{
+			const PointLight& pointLight = pointLights[j];
+			const math::Vec3 position = pointLight.getPosition();
+			__m256 dx = _mm256_sub_ps(_mm256_set1_ps(position.x()), sx);
+			__m256 dy = _mm256_sub_ps(_mm256_set1_ps(position.y()), sy);
+			__m256 dz = _mm256_sub_ps(_mm256_set1_ps(position.z()), sz);
+			const __m256 distance = _mm256_sqrt_ps(dot(dx, dy, dz, dx, dy, dz));
+			dx = _mm256_div_ps(dx, distance);
+			dy = _mm256_div_ps(dy, distance);
+			dz = _mm256_div_ps(dz, distance);
+
+			// Lanes that are in shadow don't contribute at all.
+			const __m256 visibility = load(packet.visibility[j]);
+			const __m256 lit = _mm256_cmp_ps(visibility, zero, _CMP_NEQ_OQ);
+			if (!specularOnly)
+			{
+				kD = _mm256_add_ps(kD, _mm256_and_ps(lit, _mm256_mul_ps(visibility,
+					_mm256_max_ps(zero, _mm256_div_ps(_mm256_mul_ps(dot(dx, dy, dz, nx, ny, nz),
+					_mm256_set1_ps(pointLight.strength)), _mm256_mul_ps(distance, distance))))));
+			}
+			if (!diffuseOnly)
+			{
+				const __m256 specular = _mm256_and_ps(lit, _mm256_div_ps(_mm256_mul_ps(
+					_mm256_mul_ps(visibility, specularPower(_mm256_max_ps(zero,
+					dot(fx, fy, fz, dx, dy, dz)))),
+					_mm256_set1_ps(pointLight.specularStrength * material.kT)), distance));
+				for (std::size_t i = 0; i < 3; i++)
+				{
+					kS[i] = _mm256_fmadd_ps(specular, _mm256_set1_ps(pointLight.specularColor[i]),
+						kS[i]);
+				}
+			}
+		}
+		if (!specularOnly)
+		{
+			kD = _mm256_sub_ps(one, _mm256_div_ps(one, _mm256_fmadd_ps(
+				_mm256_set1_ps(material.kM), kD, _mm256_set1_ps(material.kX))));
+		}
+
+		std::array<__m256, 3> result;
+		if (material.kR == 0.0f || !reflectionMap)
+		{
+			for (std::size_t i = 0; i < 3; i++)
+			{
+				result[i] = _mm256_fmadd_ps(kD, load(packet.color[i]), kS[i]);
+			}
+		}
+		else
+		{
+			// Cube map lookups don't vectorize, so they're done one lane at a time.
+			std::array<math::Vector<FragmentPacket::size>, 3> reflection;
+			alignas(32) std::array<float, FragmentPacket::size> rfx;
+			alignas(32) std::array<float, FragmentPacket::size> rfy;
+			alignas(32) std::array<float, FragmentPacket::size> rfz;
+			_mm256_store_ps(rfx.data(), fx);
+			_mm256_store_ps(rfy.data(), fy);
+			_mm256_store_ps(rfz.data(), fz);
+			for (std::size_t lane = 0; lane < FragmentPacket::size; lane++)
+			{
+				const math::Vec3 r = lane < packet.count ? math::Vec3(reflectionMap->lookup(
+					{rfx[lane], rfy[lane], rfz[lane]}, reflectionHit)) : math::Vec3(0.0f);
+				for (std::size_t i = 0; i < 3; i++)
+				{
+					reflection[i][lane] = r[i];
+				}
+			}
+
+			const __m256 kU = _mm256_fnmadd_ps(_mm256_set1_ps(material.kF), rn,
+				_mm256_set1_ps(material.kR));
+			const __m256 kV = _mm256_mul_ps(_mm256_sub_ps(one, kU), kD);
+			for (std::size_t i = 0; i < 3; i++)
+			{
+				result[i] = _mm256_fmadd_ps(kU, load(reflection[i]),
+					_mm256_fmadd_ps(kV, load(packet.color[i]), kS[i]));
+			}
+		}
+
+		const __m256 maximum = _mm256_max_ps(_mm256_max_ps(result[0], result[1]), result[2]);
+		const __m256 scale = _mm256_mul_ps(load(packet.color[3]), _mm256_blendv_ps(one,
+			_mm256_div_ps(one, maximum), _mm256_cmp_ps(maximum, one, _CMP_GT_OQ)));
+		alignas(32) std::array<std::array<float, FragmentPacket::size>, 4> lanes;
+		for (std::size_t i = 0; i < 3; i++)
+		{
+			_mm256_store_ps(lanes[i].data(), _mm256_mul_ps(result[i], scale));
+		}
+		_mm256_store_ps(lanes[3].data(), load(packet.color[3]));
+		for (std::size_t lane = 0; lane < packet.count; lane++)
+		{
+			colors[lane] = {lanes[0][lane], lanes[1][lane], lanes[2][lane], lanes[3][lane]};
+		}
+#else
+		for (std::size_t lane = 0; lane < packet.count; lane++)
+		{
+			colors[lane] = light(
+				{
+					packet.color[0][lane], packet.color[1][lane], packet.color[2][lane],
+					packet.color[3][lane]
+				},
+				{packet.normal[0][lane], packet.normal[1][lane], packet.normal[2][lane]},
+				{
+					packet.surfacePoint[0][lane], packet.surfacePoint[1][lane],
+					packet.surfacePoint[2][lane]
+				},
+				cameraPosition, directionalLights, pointLights,
+				[&packet, lane](const std::size_t i)
+				{
+					return packet.visibility[i][lane];
+				},
+				reflectionMap, reflectionHit, material
+			);
+		}
+#endif
+	}
+
+	using PacketLighting = void (*)(const FragmentPacket&, const RenderContext&, std::size_t&,
+		const Material&, std::array<math::Vec4, FragmentPacket::size>&);
+
+	// Pick the instantiation of light() for a material once, instead of branching on its
+	// factors for every packet.
+	PacketLighting getPacketLighting(const Material& material)
+	{
+		if (material == flat)
+		{
+			return &light<&flat>;
+		}
+		if (material == mixed)
+		{
+			return &light<&mixed>;
+		}
+		if (material == shiny)
+		{
+			return &light<&shiny>;
+		}
+		if (material == reflective)
+		{
+			return &light<&reflective>;
+		}
+		if (material == chrome)
+		{
+			return &light<&chrome>;
+		}
+		if (material == specularChrome)
+		{
+			return &light<&specularChrome>;
+		}
+		return &light<nullptr>;
+	}
 }
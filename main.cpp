@@ -9,6 +9,7 @@ import graphics;
 #include <string>
 #include <iostream>
 #include <fstream>
+#include <memory>
 #include <numbers>
 #include <cstddef>
 
@@ -17,7 +18,7 @@ class Mathics : public graphics::Window
 	static constexpr double frequency = 0.5f;
 
 	math::PinholeCamera camera;
-	std::vector<graphics::TriangleMesh> meshes;
+	std::vector<graphics::MeshInstance> meshes;
 	std::vector<graphics::DirectionalLight> directionalLights;
 	std::vector<graphics::PointLight> pointLights;
 	std::vector<graphics::Framebuffer> textures;
@@ -137,13 +138,14 @@ public:
 		for (graphics::PointLight& pointLight : pointLights)
 		{
 			pointLight.shadowMap.zClear();
-			for (const graphics::TriangleMesh& mesh : meshes)
+			for (const graphics::MeshInstance& mesh : meshes)
 			{
 				pointLight.shadowMap.prerender(mesh);
 			}
 		}
 
-		meshes[0].render(framebuffer, camera, directionalLights, pointLights);
+		const graphics::RenderContext context = {camera, directionalLights, pointLights};
+		meshes[0].render(framebuffer, context);
 		skyBox.renderOnto(reflection);
 		reflection.setPosition({0.0f, 25.0f, 200.0f});
 		for (std::size_t i = 0; i < 5; i++)
@@ -153,8 +155,7 @@ public:
 				reflection.render(meshes[i], directionalLights, pointLights);
 			}
 		}
-		graphics::reflectionMap = &reflection;
-		meshes[1].render(framebuffer, camera, directionalLights, pointLights);
+		meshes[1].render(framebuffer, {camera, directionalLights, pointLights, &reflection});
 
 		skyBox.renderOnto(reflection);
 		reflection.setPosition({0.0f, 25.0f, 0.0f});
@@ -165,10 +166,9 @@ public:
 				reflection.render(meshes[i], directionalLights, pointLights);
 			}
 		}
-		graphics::reflectionMap = &reflection;
-		meshes[2].render(framebuffer, camera, directionalLights, pointLights);
-		meshes[3].render(framebuffer, camera, directionalLights, pointLights);
-		meshes[4].render(framebuffer, camera, directionalLights, pointLights);
+		meshes[2].render(framebuffer, {camera, directionalLights, pointLights, &reflection});
+		meshes[3].render(framebuffer, context);
+		meshes[4].render(framebuffer, context);
 	}
 
 	void windowSizeCallback(GLFWwindow* window, int width, int height) override
@@ -210,42 +210,53 @@ public:
 
 	Mathics(unsigned int width, unsigned int height) : Window(width, height, "Mathics"),
 		camera(width, height, math::toRadians(70.0f), {200.0f, 50.0f, 0.0f}, {-1.0f, 0.0f, 0.0f},
-			{0.0f, 1.0f, 0.0f}), meshes(5), reflection(128, math::Vec3(0.0f)), fps(0),
+			{0.0f, 1.0f, 0.0f}), reflection(128, math::Vec3(0.0f)), fps(0),
 		prev(glfwGetTime())
 	{
 		textures.push_back(graphics::Framebuffer("grass.tiff"));
 		textures.push_back(graphics::Framebuffer("metal.tiff"));
 
-		meshes[0].texture = &textures[0];
-		meshes[0].addQuad(
+		const std::shared_ptr<graphics::TriangleMesh> ground =
+			std::make_shared<graphics::TriangleMesh>();
+		ground->texture = &textures[0];
+		ground->addQuad(
 			{-100.0f, 0.0f, 100.0f},
 			{-100.0f, 0.0f, 300.0f},
 			{100.0f, 0.0f, 300.0f},
 			{100.0f, 0.0f, 100.0f},
 			{0.0f, 0.0f}, {0.0f, 4.0f}, {4.0f, 4.0f}, {4.0f, 0.0f}
 		);
+		graphics::optimizeMesh(*ground);
 
-		meshes[1] = graphics::TriangleMesh("teapot1K.bin", &textures[1], graphics::reflective);
+		// Vertex colors are part of the geometry, so the translucent teapot needs its own copy.
+		const std::shared_ptr<graphics::TriangleMesh> teapot =
+			std::make_shared<graphics::TriangleMesh>("teapot1K.bin");
+		graphics::optimizeMesh(*teapot);
+		teapot->buildMeshlets();
+		const std::shared_ptr<graphics::TriangleMesh> translucentTeapot =
+			std::make_shared<graphics::TriangleMesh>(*teapot);
+		for (math::Vec4& color : translucentTeapot->colors)
+		{
+			color.a() = 0.5f;
+		}
+		graphics::buildLods(*teapot);
+		graphics::buildLods(*translucentTeapot);
+		teapot->compress();
+		translucentTeapot->compress();
+
+		meshes.push_back(graphics::MeshInstance(ground));
+
+		meshes.push_back(graphics::MeshInstance(teapot, &textures[1], graphics::reflective));
 		meshes[1].setCenter({0.0f, 25.0f, 200.0f});
 
-		meshes[2] = graphics::TriangleMesh("teapot1K.bin", graphics::specularChrome);
+		meshes.push_back(graphics::MeshInstance(teapot, graphics::specularChrome));
 		meshes[2].setCenter({0.0f, 25.0f, 0.0f});
 
-		meshes[3].texture = &textures[0];
-		meshes[3].addQuad(
-			{-100.0f, 0.0f, -300.0f},
-			{-100.0f, 0.0f, -100.0f},
-			{100.0f, 0.0f, -100.0f},
-			{100.0f, 0.0f, -300.0f},
-			{0.0f, 0.0f}, {0.0f, 4.0f}, {4.0f, 4.0f}, {4.0f, 0.0f}
-		);
+		meshes.push_back(graphics::MeshInstance(ground));
+		meshes[3].translate({0.0f, 0.0f, -400.0f});
 
-		meshes[4] = graphics::TriangleMesh("teapot1K.bin", graphics::shiny);
+		meshes.push_back(graphics::MeshInstance(translucentTeapot, graphics::shiny));
 		meshes[4].setCenter({0.0f, 25.0f, -200.0f});
-		for (math::Vec4& color : meshes[4].colors)
-		{
-			color.a() = 0.5f;
-		}
 
 		directionalLights.push_back(graphics::DirectionalLight({0.0f, 1.0f, 0.0f}, 0.1f));
 		pointLights.push_back(graphics::PointLight(512, {75.0f, 50.0f, 250.0f}, 10000.0f,
@@ -266,6 +277,13 @@ public:
 
 int main(int argc, char* argv[])
 {
+	// Mathics <input.bin> <output.mesh> converts a mesh instead of opening a window.
+	if (argc == 3)
+	{
+		graphics::convertBinToMeshFile(argv[1], argv[2]);
+		return 0;
+	}
+
 	Mathics window = Mathics(1000, 600);
 	window.loop();
 	return 0;
@@ -1,345 +1,484 @@
 import math;
 import graphics;
 
+#include <array>
 #include <vector>
+#include <algorithm>
 #include <cmath>
+#include <cstdint>
+#include <cstddef>
+#include <tuple>
 
 namespace graphics
 {
-	// In a separate file to avoid a cyclic dependency.
-	void Framebuffer::renderTriangle(const math::PinholeCamera& camera,
-		const math::Vec3& t1, const math::Vec3& t2, const math::Vec3& t3,
-		const math::Vec4& c1, const math::Vec4& c2, const math::Vec4& c3,
-		const math::Vec3& n1, const math::Vec3& n2, const math::Vec3& n3,
-		std::vector<DirectionalLight>& directionalLights, std::vector<PointLight>& pointLights,
-		const Material& material)
+	// Set up the parts of the shadow map coordinates that are the same for every fragment seen
+	// by the camera.
+	void prepareShadowSamplers(ShadingScratch& scratch, const RenderContext& context)
 	{
-		// https://fgiesen.wordpress.com/2013/02/08/triangle-rasterization-in-practice/
-		// https://fgiesen.wordpress.com/2013/02/10/optimizing-the-basic-rasterizer/
-		// http://devmaster.net/forums/topic/1145-advanced-rasterization/ (accessible with
-		// Wayback Machine)
-
-		// Back-face culling.
-		if ((t1 - camera.center).dot((t2 - t1).cross(t3 - t1)) >= 0.0f)
+		const math::PinholeCamera& camera = context.camera;
+		const math::Mat3 cm1 = math::Mat3(camera.a, camera.b, camera.c).transpose();
+		for (std::size_t j = 0; j < context.pointLights.size(); j++)
 		{
-			return;
+			const CubeMap& shadowMap = context.pointLights[j].shadowMap;
+			CubeMapSampler& sampler = scratch.shadowSamplers[j];
+			for (std::size_t i = 0; i < 3; i++)
+			{
+				sampler.sc[i] = shadowMap.cameras[i].projectionMatrix * cm1;
+				sampler.sf[i] = shadowMap.cameras[i].projectionMatrix *
+					(camera.center - shadowMap.cameras[i].center);
+			}
 		}
+	}
 
-		const math::Vec3 p1 = camera.project(t1);
-		const math::Vec3 p2 = camera.project(t2);
-		const math::Vec3 p3 = camera.project(t3);
+	// Add a fragment to the packet, along with its shadow map visibility for every point light.
+	// The shadow map coordinates are only computed here, so fragments that fail the coverage or
+	// depth test never pay for them. Returns the lane of the fragment.
+	std::size_t addFragment(ShadingScratch& scratch, const int x, const int y,
+		const math::Vec4& color, const math::Vec3& normal, const math::Vec3& surfacePoint,
+		const std::vector<PointLight>& pointLights, const float w)
+	{
+		const std::size_t lane = scratch.packet.add(color, normal, surfacePoint);
+		const math::Vec3 lv = math::Vec3(static_cast<float>(x), static_cast<float>(y), 1.0f);
+		for (std::size_t i = 0; i < pointLights.size(); i++)
+		{
+			CubeMapSampler& sampler = scratch.shadowSamplers[i];
+			for (std::size_t k = 0; k < 3; k++)
+			{
+				sampler.p[k] = sampler.sc[k] * lv + w * sampler.sf[k];
+			}
+			scratch.packet.visibility[i][lane] = pointLights[i].shadowMap.getVisibility(sampler,
+				w);
+		}
+		scratch.columns[lane] = x;
+		return lane;
+	}
 
-		if (p1.z() <= 0.0f || p2.z() <= 0.0f || p3.z() <= 0.0f)
+	// Light the fragments of the packet and write them into a row of pixels. Fragments are only
+	// blended with what is already there if the layout they come from can be translucent.
+	template<bool blended>
+	void shadePacket(ShadingScratch& scratch, math::Vec4* row, const RenderContext& context,
+		const PacketLighting lighting, const Material& material)
+	{
+		FragmentPacket& packet = scratch.packet;
+		if (packet.count == 0)
 		{
 			return;
 		}
 
-		// 4-bit subpixel precision.
-		const int p1x = static_cast<int>(std::round(p1.x() * 16.0f));
-		const int p1y = static_cast<int>(std::round(p1.y() * 16.0f));
-		const int p2x = static_cast<int>(std::round(p2.x() * 16.0f));
-		const int p2y = static_cast<int>(std::round(p2.y() * 16.0f));
-		const int p3x = static_cast<int>(std::round(p3.x() * 16.0f));
-		const int p3y = static_cast<int>(std::round(p3.y() * 16.0f));
-
-		const int minX = std::max((std::min(std::min(p1x, p2x), p3x) + 15) >> 4, 0);
-		const int minY = std::max((std::min(std::min(p1y, p2y), p3y) + 15) >> 4, 0);
-		const int maxX = std::min(
-			(std::max(std::max(p1x, p2x), p3x) + 15) >> 4,
-			static_cast<int>(width) - 1
-		);
-		const int maxY = std::min(
-			(std::max(std::max(p1y, p2y), p3y) + 15) >> 4,
-			static_cast<int>(height) - 1
-		);
-
-		const int a1 = p1y - p2y;
-		const int a2 = p2y - p3y;
-		const int a3 = p3y - p1y;
-		const int b1 = p2x - p1x;
-		const int b2 = p3x - p2x;
-		const int b3 = p1x - p3x;
-
-		const int fa1 = a1 << 4;
-		const int fa2 = a2 << 4;
-		const int fa3 = a3 << 4;
-		const int fb1 = b1 << 4;
-		const int fb2 = b2 << 4;
-		const int fb3 = b3 << 4;
-
-		int u1 = (p3x - p2x) * ((minY << 4) - p2y) - (p3y - p2y) * ((minX << 4) - p2x);
-		int u2 = (p1x - p3x) * ((minY << 4) - p3y) - (p1y - p3y) * ((minX << 4) - p3x);
-		int u3 = (p2x - p1x) * ((minY << 4) - p1y) - (p2y - p1y) * ((minX << 4) - p1x);
-
-		const math::Vec3 lv = math::Vec3(static_cast<float>(minX), static_cast<float>(minY), 1.0f);
-		const math::Matrix<3, 8> rc = (math::Mat3(
-			p1.x(), p1.y(), 1.0f,
-			p2.x(), p2.y(), 1.0f,
-			p3.x(), p3.y(), 1.0f
-		).inverse() * math::Matrix<3, 8>(
-			p1.z(), c1.r(), c1.g(), c1.b(), c1.a(), n1.x(), n1.y(), n1.z(),
-			p2.z(), c2.r(), c2.g(), c2.b(), c2.a(), n2.x(), n2.y(), n2.z(),
-			p3.z(), c3.r(), c3.g(), c3.b(), c3.a(), n3.x(), n3.y(), n3.z()
-		));
-		math::Vector<8> q = lv * rc;
-
-		const math::Mat3 cm1 = math::Mat3(camera.a, camera.b, camera.c).transpose();
-		for (PointLight& pointLight : pointLights)
+		std::array<math::Vec4, FragmentPacket::size> colors;
+		lighting(packet, context, scratch.reflectionHit, material, colors);
+		for (std::size_t lane = 0; lane < packet.count; lane++)
 		{
-			for (std::size_t i = 0; i < 3; i++)
+			math::Vec4& pixel = row[scratch.columns[lane]];
+			if constexpr (blended)
+			{
+				pixel = colors[lane] + (1.0f - colors[lane].a()) * pixel;
+			}
+			else
 			{
-				const math::Vec3 sf = pointLight.shadowMap.cameras[i].projectionMatrix *
-					(camera.center - pointLight.shadowMap.cameras[i].center);
-				pointLight.shadowMap.cameras[i].sc =
-					pointLight.shadowMap.cameras[i].projectionMatrix * cm1;
-				pointLight.shadowMap.cameras[i].sp = q[0] * sf +
-					pointLight.shadowMap.cameras[i].sc * lv;
-				pointLight.shadowMap.cameras[i].sc[0][0] += rc[0][0] * sf[0];
-				pointLight.shadowMap.cameras[i].sc[1][0] += rc[0][0] * sf[1];
-				pointLight.shadowMap.cameras[i].sc[2][0] += rc[0][0] * sf[2];
-				pointLight.shadowMap.cameras[i].sc[0][1] += rc[1][0] * sf[0];
-				pointLight.shadowMap.cameras[i].sc[1][1] += rc[1][0] * sf[1];
-				pointLight.shadowMap.cameras[i].sc[2][1] += rc[1][0] * sf[2];
+				pixel = colors[lane];
 			}
 		}
+		packet.count = 0;
+	}
+
+	// Vertex layouts for Framebuffer::shadeTriangle(). Column 0 of the rates of a layout is the
+	// depth, the other columns are exactly what the layout needs for the albedo and the normal of
+	// a fragment.
+	template<bool translucent>
+	struct ColorLayout
+	{
+		// Opaque triangles have no use for the alpha channel.
+		static constexpr bool blended = translucent;
+		static constexpr std::size_t colorSize = translucent ? 4 : 3;
+		static constexpr std::size_t size = 1 + colorSize + 3;
+
+		math::Matrix<3, size> rates;
 
-		math::Vec4* cb = buffer.data() + minY * width;
-		float* zb = zBuffer.data() + minY * width;
-		for (int y = minY; y <= maxY; y++)
+		ColorLayout(const TriangleSetup& setup,
+			const math::Vec4& c1, const math::Vec4& c2, const math::Vec4& c3,
+			const math::Vec3& n1, const math::Vec3& n2, const math::Vec3& n3)
 		{
-			int v1 = u1;
-			int v2 = u2;
-			int v3 = u3;
-			math::Vector<8> p = q;
-			for (PointLight& pointLight : pointLights)
+			const std::array<math::Vec4, 3> colors = {c1, c2, c3};
+			const std::array<math::Vec3, 3> normals = {n1, n2, n3};
+			math::Matrix<3, size> attributes(0.0f);
+			for (std::size_t k = 0; k < 3; k++)
 			{
+				for (std::size_t i = 0; i < colorSize; i++)
+				{
+					attributes[k][1 + i] = colors[k][i];
+				}
 				for (std::size_t i = 0; i < 3; i++)
 				{
-					pointLight.shadowMap.cameras[i].p = pointLight.shadowMap.cameras[i].sp;
+					attributes[k][1 + colorSize + i] = normals[k][i];
 				}
 			}
 
-			for (int x = minX; x <= maxX; x++)
+			// The depth gets interpolated across the clipped triangle rather than the original
+			// one.
+			rates = setup.interpolation * attributes;
+			for (std::size_t k = 0; k < 3; k++)
 			{
-				if ((v1 | v2 | v3) >= 0 && p[0] >= zb[x])
-				{
-					const math::Vec4 color = light(
-						p.subvector<1, 5>(), p.subvector<5, 8>().unit(),
-						camera.unproject({static_cast<float>(x), static_cast<float>(y), p[0]}),
-						camera.center, directionalLights, pointLights, p[0], material
-					);
-					cb[x] = color + (1.0f - color.a()) * cb[x];
-				}
+				rates[k][0] = setup.depth[k];
+			}
+		}
+
+		math::Vec4 getAlbedo(const math::Vector<size>& p) const
+		{
+			if constexpr (translucent)
+			{
+				return p.template subvector<1, 5>();
+			}
+			else
+			{
+				return math::Vec4(p[1], p[2], p[3], 1.0f);
+			}
+		}
+		math::Vec3 getNormal(const math::Vector<size>& p) const
+		{
+			return p.template subvector<1 + colorSize, size>().unit();
+		}
+	};
+
+	// The texture coordinates are interpolated in perspective, along with the divisor that
+	// undoes it.
+	struct TextureLayout
+	{
+		static constexpr bool blended = true;
+		static constexpr std::size_t size = 7;
+
+		const Framebuffer& texture;
+		math::Matrix<3, size> rates;
+
+		TextureLayout(const TriangleSetup& setup, const math::PinholeCamera& camera,
+			const Framebuffer& texture,
+			const math::Vec3& t1, const math::Vec3& t2, const math::Vec3& t3,
+			const math::Vec2& r1, const math::Vec2& r2, const math::Vec2& r3,
+			const math::Vec3& n1, const math::Vec3& n2, const math::Vec3& n3) : texture(texture)
+		{
+			const math::Matrix<3, 4> rc = setup.interpolation * math::Matrix<3, 4>(
+				0.0f, n1.x(), n1.y(), n1.z(),
+				0.0f, n2.x(), n2.y(), n2.z(),
+				0.0f, n3.x(), n3.y(), n3.z()
+			);
+
+			const math::Mat3 cm = math::Mat3(camera.a, camera.b, camera.c);
+			const math::Mat3 tc = cm * math::Mat3(t1 - camera.center, t2 - camera.center, t3 -
+				camera.center).inverse();
+			const math::Matrix<3, 2> dc = tc * math::Matrix<3, 2>(r1, r2, r3);
+			const math::Vec3 nc = {tc[0].sum(), tc[1].sum(), tc[2].sum()};
+
+			for (std::size_t k = 0; k < 3; k++)
+			{
+				rates[k] = math::Vector<size>(setup.depth[k], rc[k][1], rc[k][2], rc[k][3],
+					dc[k][0], dc[k][1], nc[k]);
+			}
+		}
 
-				v1 += fa2;
-				v2 += fa3;
-				v3 += fa1;
-				p += rc[0];
-				for (PointLight& pointLight : pointLights)
+		math::Vec4 getAlbedo(const math::Vector<size>& p) const
+		{
+			return texture.textureLookup(p[4] / p[6], p[5] / p[6]);
+		}
+		math::Vec3 getNormal(const math::Vector<size>& p) const
+		{
+			return p.subvector<1, 4>().unit();
+		}
+	};
+
+	// In a separate file to avoid a cyclic dependency.
+	template<typename MakeLayout>
+	void Framebuffer::shadeTriangle(const TriangleSetup& setup, const Tile& tile,
+		const RenderContext& context, const MakeLayout& makeLayout, const Material& material)
+	{
+		using Layout = decltype(makeLayout());
+
+		const math::PinholeCamera& camera = context.camera;
+		const std::vector<PointLight>& pointLights = context.pointLights;
+		ShadingScratch& scratch = getShadingScratch(pointLights.size());
+		const PacketLighting lighting = getPacketLighting(material);
+
+		// Few enough pixels to test each of them directly, and to light them in a single packet.
+		const int minX = std::max(setup.minX, tile.minX);
+		const int minY = std::max(setup.minY, tile.minY);
+		const int maxX = std::min(setup.maxX, tile.maxX);
+		const int maxY = std::min(setup.maxY, tile.maxY);
+		if ((maxX - minX + 1) * (maxY - minY + 1) <= smallTriangleSize)
+		{
+			static_assert(smallTriangleSize <= FragmentPacket::size);
+			std::array<math::Vec3, smallTriangleSize> pixels;
+			std::size_t count = 0;
+			for (int y = minY; y <= maxY; y++)
+			{
+				for (int x = minX; x <= maxX; x++)
 				{
-					for (std::size_t i = 0; i < 3; i++)
+					const math::Vec3 lv = math::Vec3(static_cast<float>(x),
+						static_cast<float>(y), 1.0f);
+					if (setup.covers(x, y) && setup.depth.dot(lv) >= zBuffer[y * width + x])
 					{
-						pointLight.shadowMap.cameras[i].p +=
-							pointLight.shadowMap.cameras[i].sc.getColumn(0);
+						pixels[count++] = lv;
 					}
 				}
 			}
+			if (count == 0)
+			{
+				return;
+			}
 
-			u1 += fb2;
-			u2 += fb3;
-			u3 += fb1;
-			q += rc[1];
-			for (PointLight& pointLight : pointLights)
+			const Layout layout = makeLayout();
+			prepareShadowSamplers(scratch, context);
+			for (std::size_t i = 0; i < count; i++)
 			{
-				for (std::size_t i = 0; i < 3; i++)
+				const math::Vec3& lv = pixels[i];
+				const math::Vector<Layout::size> p = lv * layout.rates;
+				const int x = static_cast<int>(lv.x());
+				const int y = static_cast<int>(lv.y());
+				const std::size_t lane = addFragment(scratch, x, y, layout.getAlbedo(p),
+					layout.getNormal(p), camera.unproject({lv.x(), lv.y(), p[0]}), pointLights,
+					p[0]);
+				scratch.columns[lane] = y * static_cast<int>(width) + x;
+			}
+			shadePacket<Layout::blended>(scratch, buffer.data(), context, lighting, material);
+			return;
+		}
+
+		const Layout layout = makeLayout();
+		const int fa1 = (setup.p1y - setup.p2y) << 4;
+		const int fa2 = (setup.p2y - setup.p3y) << 4;
+		const int fa3 = (setup.p3y - setup.p1y) << 4;
+		const int fb1 = (setup.p2x - setup.p1x) << 4;
+		const int fb2 = (setup.p3x - setup.p2x) << 4;
+		const int fb3 = (setup.p1x - setup.p3x) << 4;
+
+		const math::Matrix<3, Layout::size>& rc = layout.rates;
+
+		prepareShadowSamplers(scratch, context);
+
+		forEachBlock(setup, tile, [&](const Block& block)
+			{
+				if (isOccluded(setup, block))
 				{
-					pointLight.shadowMap.cameras[i].sp +=
-						pointLight.shadowMap.cameras[i].sc.getColumn(1);
+					return;
+				}
+				const bool unoccluded = isUnoccluded(setup, block);
+
+				int u1 = block.u1;
+				int u2 = block.u2;
+				int u3 = block.u3;
+				const math::Vec3 lv = math::Vec3(static_cast<float>(block.minX),
+					static_cast<float>(block.minY), 1.0f);
+				math::Vector<Layout::size> q = lv * rc;
+
+				math::Vec4* cb = buffer.data() + block.minY * width;
+				float* zb = zBuffer.data() + block.minY * width;
+				for (int y = block.minY; y <= block.maxY; y++)
+				{
+					int v1 = u1;
+					int v2 = u2;
+					int v3 = u3;
+					math::Vector<Layout::size> p = q;
+					int first = block.minX;
+					int last = block.maxX;
+					if (setup.spans && !block.full)
+					{
+						std::tie(first, last) = getSpan(setup, block, u1, u2, u3);
+						const int skip = std::max(first - block.minX, 0);
+						v1 += skip * fa2;
+						v2 += skip * fa3;
+						v3 += skip * fa1;
+						p += static_cast<float>(skip) * rc[0];
+					}
+
+					for (int x = first; x <= last; x++)
+					{
+						if ((block.full || (v1 | v2 | v3) >= 0) && (unoccluded || p[0] >= zb[x]))
+						{
+							addFragment(scratch, x, y, layout.getAlbedo(p), layout.getNormal(p),
+								camera.unproject({
+									static_cast<float>(x), static_cast<float>(y), p[0]
+								}),
+								pointLights, p[0]
+							);
+						}
+
+						v1 += fa2;
+						v2 += fa3;
+						v3 += fa1;
+						p += rc[0];
+					}
+
+					// A row of a block never holds more fragments than a packet.
+					shadePacket<Layout::blended>(scratch, cb, context, lighting, material);
+
+					u1 += fb2;
+					u2 += fb3;
+					u3 += fb1;
+					q += rc[1];
+					cb += width;
+					zb += width;
 				}
 			}
-			cb += width;
-			zb += width;
-		}
+		);
 	}
 
-	void Framebuffer::renderTriangle(const math::PinholeCamera& camera, const Framebuffer& texture,
-		const math::Vec3& t1, const math::Vec3& t2, const math::Vec3& t3,
-		const math::Vec2& r1, const math::Vec2& r2, const math::Vec2& r3,
+	void Framebuffer::renderTriangle(const TriangleSetup& setup, const Tile& tile,
+		const RenderContext& context,
+		const math::Vec4& c1, const math::Vec4& c2, const math::Vec4& c3,
 		const math::Vec3& n1, const math::Vec3& n2, const math::Vec3& n3,
-		std::vector<DirectionalLight>& directionalLights, std::vector<PointLight>& pointLights,
 		const Material& material)
 	{
-		// https://fgiesen.wordpress.com/2013/02/08/triangle-rasterization-in-practice/
-		// https://fgiesen.wordpress.com/2013/02/10/optimizing-the-basic-rasterizer/
-		// http://devmaster.net/forums/topic/1145-advanced-rasterization/ (accessible with
-		// Wayback Machine)
-
-		// Back-face culling.
-		if ((t1 - camera.center).dot((t2 - t1).cross(t3 - t1)) >= 0.0f)
+		if (isOccluded(setup, tile))
 		{
 			return;
 		}
 
-		const math::Vec3 p1 = camera.project(t1);
-		const math::Vec3 p2 = camera.project(t2);
-		const math::Vec3 p3 = camera.project(t3);
+		if (c1.a() >= 1.0f && c2.a() >= 1.0f && c3.a() >= 1.0f)
+		{
+			shadeTriangle(setup, tile, context, [&]()
+				{
+					return ColorLayout<false>(setup, c1, c2, c3, n1, n2, n3);
+				},
+				material
+			);
+		}
+		else
+		{
+			shadeTriangle(setup, tile, context, [&]()
+				{
+					return ColorLayout<true>(setup, c1, c2, c3, n1, n2, n3);
+				},
+				material
+			);
+		}
+	}
 
-		if (p1.z() <= 0.0f || p2.z() <= 0.0f || p3.z() <= 0.0f)
+	void Framebuffer::renderTriangle(const TriangleSetup& setup, const Tile& tile,
+		const RenderContext& context, const Framebuffer& texture,
+		const math::Vec3& t1, const math::Vec3& t2, const math::Vec3& t3,
+		const math::Vec2& r1, const math::Vec2& r2, const math::Vec2& r3,
+		const math::Vec3& n1, const math::Vec3& n2, const math::Vec3& n3,
+		const Material& material)
+	{
+		if (isOccluded(setup, tile))
 		{
 			return;
 		}
 
-		// 4-bit subpixel precision.
-		const int p1x = static_cast<int>(std::round(p1.x() * 16.0f));
-		const int p1y = static_cast<int>(std::round(p1.y() * 16.0f));
-		const int p2x = static_cast<int>(std::round(p2.x() * 16.0f));
-		const int p2y = static_cast<int>(std::round(p2.y() * 16.0f));
-		const int p3x = static_cast<int>(std::round(p3.x() * 16.0f));
-		const int p3y = static_cast<int>(std::round(p3.y() * 16.0f));
-
-		const int minX = std::max((std::min(std::min(p1x, p2x), p3x) + 15) >> 4, 0);
-		const int minY = std::max((std::min(std::min(p1y, p2y), p3y) + 15) >> 4, 0);
-		const int maxX = std::min(
-			(std::max(std::max(p1x, p2x), p3x) + 15) >> 4,
-			static_cast<int>(width) - 1
-		);
-		const int maxY = std::min(
-			(std::max(std::max(p1y, p2y), p3y) + 15) >> 4,
-			static_cast<int>(height) - 1
+		shadeTriangle(setup, tile, context, [&]()
+			{
+				return TextureLayout(setup, context.camera, texture, t1, t2, t3, r1, r2, r3, n1,
+					n2, n3);
+			},
+			material
 		);
+	}
 
-		const int a1 = p1y - p2y;
-		const int a2 = p2y - p3y;
-		const int a3 = p3y - p1y;
-		const int b1 = p2x - p1x;
-		const int b2 = p3x - p2x;
-		const int b3 = p1x - p3x;
-
-		const int fa1 = a1 << 4;
-		const int fa2 = a2 << 4;
-		const int fa3 = a3 << 4;
-		const int fb1 = b1 << 4;
-		const int fb2 = b2 << 4;
-		const int fb3 = b3 << 4;
-
-		int u1 = (p3x - p2x) * ((minY << 4) - p2y) - (p3y - p2y) * ((minX << 4) - p2x);
-		int u2 = (p1x - p3x) * ((minY << 4) - p3y) - (p1y - p3y) * ((minX << 4) - p3x);
-		int u3 = (p2x - p1x) * ((minY << 4) - p1y) - (p2y - p1y) * ((minX << 4) - p1x);
-
-		const math::Vec3 lv = math::Vec3(static_cast<float>(minX), static_cast<float>(minY), 1.0f);
-		const math::Matrix<3, 4> rc = (math::Mat3(
-			p1.x(), p1.y(), 1.0f,
-			p2.x(), p2.y(), 1.0f,
-			p3.x(), p3.y(), 1.0f
-		).inverse() * math::Matrix<3, 4>(
-			p1.z(), n1.x(), n1.y(), n1.z(),
-			p2.z(), n2.x(), n2.y(), n2.z(),
-			p3.z(), n3.x(), n3.y(), n3.z()
-		));
-		math::Vector<4> q = lv * rc;
-
-		const math::Mat3 cm = math::Mat3(camera.a, camera.b, camera.c);
-		const math::Mat3 cm1 = cm.transpose();
-		for (PointLight& pointLight : pointLights)
+	void Framebuffer::renderTriangle(const RenderContext& context,
+		const math::Vec3& t1, const math::Vec3& t2, const math::Vec3& t3,
+		const math::Vec4& c1, const math::Vec4& c2, const math::Vec4& c3,
+		const math::Vec3& n1, const math::Vec3& n2, const math::Vec3& n3,
+		const Material& material)
+	{
+		std::array<TriangleSetup, maxClippedTriangles> setups;
+		const std::size_t count = setupTriangle(context.camera, t1, t2, t3, setups);
+		for (std::size_t i = 0; i < count; i++)
 		{
-			for (std::size_t i = 0; i < 3; i++)
+			if (setups[i].visible)
 			{
-				const math::Vec3 sf = pointLight.shadowMap.cameras[i].projectionMatrix *
-					(camera.center - pointLight.shadowMap.cameras[i].center);
-				pointLight.shadowMap.cameras[i].sc =
-					pointLight.shadowMap.cameras[i].projectionMatrix * cm1;
-				pointLight.shadowMap.cameras[i].sp = q[0] * sf +
-					pointLight.shadowMap.cameras[i].sc * lv;
-				pointLight.shadowMap.cameras[i].sc[0][0] += rc[0][0] * sf[0];
-				pointLight.shadowMap.cameras[i].sc[1][0] += rc[0][0] * sf[1];
-				pointLight.shadowMap.cameras[i].sc[2][0] += rc[0][0] * sf[2];
-				pointLight.shadowMap.cameras[i].sc[0][1] += rc[1][0] * sf[0];
-				pointLight.shadowMap.cameras[i].sc[1][1] += rc[1][0] * sf[1];
-				pointLight.shadowMap.cameras[i].sc[2][1] += rc[1][0] * sf[2];
+				forEachTile(setups[i], [&](const std::size_t, const Tile& tile)
+					{
+						renderTriangle(setups[i], tile, context, c1, c2, c3, n1, n2, n3,
+							material);
+					}
+				);
 			}
 		}
+	}
 
-		const math::Mat3 tc = cm * math::Mat3(t1 - camera.center, t2 - camera.center, t3 -
-			camera.center).inverse();
-		const math::Matrix<3, 2> dc = tc * math::Matrix<3, 2>(r1, r2, r3);
-		const math::Vec3 nc = {tc[0].sum(), tc[1].sum(), tc[2].sum()};
-		float rdx = dc.getColumn(0).dot(lv);
-		float rdy = dc.getColumn(1).dot(lv);
-		float rn = nc.dot(lv);
-
-		math::Vec4* cb = buffer.data() + minY * width;
-		float* zb = zBuffer.data() + minY * width;
-		for (int y = minY; y <= maxY; y++)
+	void Framebuffer::renderTriangle(const RenderContext& context, const Framebuffer& texture,
+		const math::Vec3& t1, const math::Vec3& t2, const math::Vec3& t3,
+		const math::Vec2& r1, const math::Vec2& r2, const math::Vec2& r3,
+		const math::Vec3& n1, const math::Vec3& n2, const math::Vec3& n3,
+		const Material& material)
+	{
+		std::array<TriangleSetup, maxClippedTriangles> setups;
+		const std::size_t count = setupTriangle(context.camera, t1, t2, t3, setups);
+		for (std::size_t i = 0; i < count; i++)
 		{
-			int v1 = u1;
-			int v2 = u2;
-			int v3 = u3;
-			math::Vector<4> p = q;
-			float dx = rdx;
-			float dy = rdy;
-			float n = rn;
-			for (PointLight& pointLight : pointLights)
+			if (setups[i].visible)
 			{
-				for (std::size_t i = 0; i < 3; i++)
-				{
-					pointLight.shadowMap.cameras[i].p = pointLight.shadowMap.cameras[i].sp;
-				}
+				forEachTile(setups[i], [&](const std::size_t, const Tile& tile)
+					{
+						renderTriangle(setups[i], tile, context, texture, t1, t2, t3, r1, r2, r3,
+							n1, n2, n3, material);
+					}
+				);
 			}
+		}
+	}
 
-			for (int x = minX; x <= maxX; x++)
+	// Neighbouring pixels may belong to different triangles, so the attributes of every pixel are
+	// interpolated from its barycentric coordinates instead of being stepped across a triangle.
+	void Framebuffer::resolveVisibility(const Tile& tile, const std::uint32_t* visibility,
+		const TriangleMesh& mesh, const DrawParameters& draw,
+		const std::vector<TriangleSetup>& setups, const RenderContext& context)
+	{
+		const math::PinholeCamera& camera = context.camera;
+		const std::vector<PointLight>& pointLights = context.pointLights;
+		ShadingScratch& scratch = getShadingScratch(pointLights.size());
+		const PacketLighting lighting = getPacketLighting(draw.material);
+
+		prepareShadowSamplers(scratch, context);
+
+		for (int y = tile.minY; y <= tile.maxY; y++)
+		{
+			const std::uint32_t* vb = visibility + (y - tile.minY) * tileSize - tile.minX;
+			math::Vec4* cb = buffer.data() + y * width;
+			for (int x = tile.minX; x <= tile.maxX; x++)
 			{
-				if ((v1 | v2 | v3) >= 0 && p[0] >= zb[x])
+				if (vb[x] == noTriangle)
 				{
-					float tx = dx / n;
-					const float fx = std::floor(tx);
-					float ty = dy / n;
-					const float fy = std::floor(ty);
-					tx = static_cast<int>(fx) % 2 ? 1.0f + fx - tx : tx - fx;
-					ty = static_cast<int>(fy) % 2 ? 1.0f + fy - ty : ty - fy;
-					tx *= static_cast<float>(texture.getWidth() - 1);
-					ty *= static_cast<float>(texture.getHeight() - 1);
-					const math::Vec4 color = light(
-						texture.bilinearLookup(tx, ty), p.subvector<1, 4>().unit(),
-						camera.unproject({static_cast<float>(x), static_cast<float>(y), p[0]}),
-						camera.center, directionalLights, pointLights, p[0], material
-					);
-					cb[x] = color + (1.0f - color.a()) * cb[x];
+					continue;
 				}
 
-				v1 += fa2;
-				v2 += fa3;
-				v3 += fa1;
-				p += rc[0];
-				dx += dc[0][0];
-				dy += dc[0][1];
-				n += nc[0];
-				for (PointLight& pointLight : pointLights)
+				const TriangleSetup& setup = setups[vb[x]];
+				const std::array<unsigned int, 3> triangle = mesh.getTriangle(setup.triangle);
+				const math::Vec3 lv = math::Vec3(static_cast<float>(x), static_cast<float>(y),
+					1.0f);
+				const math::Vec3 b = lv * setup.interpolation;
+				const float z = setup.depth.dot(lv);
+
+				math::Vec4 albedo;
+				if (draw.texture)
 				{
-					for (std::size_t i = 0; i < 3; i++)
-					{
-						pointLight.shadowMap.cameras[i].p +=
-							pointLight.shadowMap.cameras[i].sc.getColumn(0);
-					}
+					// Perspective-correct weights. The clipped vertices are always in front of the
+					// camera, unlike the vertices of the triangle that was clipped.
+					const math::Vec3 c = lv * setup.inverse;
+					const math::Vec3 pb = math::Vec3(c[0] * setup.p1.z(), c[1] * setup.p2.z(),
+						c[2] * setup.p3.z()) / z * setup.weights;
+					const math::Vec2 r = pb[0] * mesh.getTextureCoordinate(triangle[0]) +
+						pb[1] * mesh.getTextureCoordinate(triangle[1]) +
+						pb[2] * mesh.getTextureCoordinate(triangle[2]);
+					albedo = draw.texture->textureLookup(r.x(), r.y());
 				}
-			}
-
-			u1 += fb2;
-			u2 += fb3;
-			u3 += fb1;
-			q += rc[1];
-			rdx += dc[1][0];
-			rdy += dc[1][1];
-			rn += nc[1];
-			for (PointLight& pointLight : pointLights)
-			{
-				for (std::size_t i = 0; i < 3; i++)
+				else
+				{
+					albedo = b[0] * mesh.getColor(triangle[0]) + b[1] * mesh.getColor(triangle[1]) +
+						b[2] * mesh.getColor(triangle[2]);
+				}
+				// Rotating the interpolated normal is the same as interpolating rotated normals.
+				const math::Vec3 normal = (draw.transform.rotation * (b[0] *
+					mesh.getNormal(triangle[0]) + b[1] * mesh.getNormal(triangle[1]) +
+					b[2] * mesh.getNormal(triangle[2]))).unit();
+
+				addFragment(scratch, x, y, albedo, normal,
+					camera.unproject({static_cast<float>(x), static_cast<float>(y), z}),
+					pointLights, z);
+				if (scratch.packet.count == FragmentPacket::size)
 				{
-					pointLight.shadowMap.cameras[i].sp +=
-						pointLight.shadowMap.cameras[i].sc.getColumn(1);
+					shadePacket<true>(scratch, cb, context, lighting, draw.material);
 				}
 			}
-			cb += width;
-			zb += width;
+			shadePacket<true>(scratch, cb, context, lighting, draw.material);
 		}
 	}
 }